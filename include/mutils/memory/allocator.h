@@ -1,8 +1,19 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdlib>
+
 namespace MUtils
 {
 
+#ifdef MUTILS_PROFILER_ALLOCATIONS
+namespace Profiler
+{
+void RecordAllocation(size_t size);
+void RecordFree(size_t size);
+}
+#endif
+
 // Example C++17 Allocator
 template <typename T>
 class stl_allocator
@@ -18,10 +29,16 @@ public:
     stl_allocator(const stl_allocator<U>&) {}
     pointer allocate(size_type n)
     {
+#ifdef MUTILS_PROFILER_ALLOCATIONS
+        Profiler::RecordAllocation(n * sizeof(T));
+#endif
         return (pointer)malloc(n * sizeof(T));
     }
     void deallocate(pointer p, size_type n)
     {
+#ifdef MUTILS_PROFILER_ALLOCATIONS
+        Profiler::RecordFree(n * sizeof(T));
+#endif
         // Free knows how big the block is
         (void)&n;
         free(p);
@@ -2,9 +2,17 @@
 #pragma once
 
 #include <concurrentqueue/concurrentqueue.h>
+#include <atomic>
 #include <cstdint>
 #include <cassert>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <type_traits>
+#include <vector>
 
 #include <ctti/type_id.hpp>
 
@@ -15,15 +23,110 @@ namespace MUtils
 
 struct IListItem;
 
+// A snapshot of a pool's counters.
+// The counters are relaxed atomics, so a snapshot taken while other threads use the pool is approximate.
+struct PoolStats
+{
+    uint64_t liveItems = 0; // Handed out by Alloc, and not yet freed
+    uint64_t freeItems = 0; // Constructed, and waiting to be handed out
+    uint64_t peakLiveItems = 0; // High water mark of liveItems
+    uint64_t misses = 0; // Allocs which found no free item, and had to grow the pool
+    uint64_t bytesReserved = 0; // Slab memory held by the pool
+};
+
+template <class T>
+class ListRange;
+
+// A doubly linked list threaded through IListItems, with O(1) size, ends and range splicing.
+// The list does not own its items, and an item can only be in one list at a time.
+// Removing a range without saying how long it is leaves the size unknown, until Size() next counts it.
+class IntrusiveList
+{
+public:
+    static const size_t UnknownSize = size_t(-1);
+
+    IListItem* Front() const
+    {
+        return m_pFront;
+    }
+
+    IListItem* Back() const
+    {
+        return m_pBack;
+    }
+
+    bool Empty() const
+    {
+        return m_pFront == nullptr;
+    }
+
+    size_t Size() const;
+
+    void PushFront(gsl::not_null<IListItem*> pItem);
+    void PushBack(gsl::not_null<IListItem*> pItem);
+
+    // A null position inserts at the front/back respectively
+    void InsertAfter(IListItem* pPos, gsl::not_null<IListItem*> pItem);
+    void InsertBefore(IListItem* pPos, gsl::not_null<IListItem*> pItem);
+
+    // Unlink an item, returning the one that followed it
+    IListItem* Erase(gsl::not_null<IListItem*> pItem);
+
+    // Unlink the items [pFirst, pLast], returning the one that followed them.
+    // The range keeps its internal links, so it can be walked or spliced elsewhere.
+    IListItem* EraseRange(gsl::not_null<IListItem*> pFirst, gsl::not_null<IListItem*> pLast, size_t count = UnknownSize);
+
+    // Move [pFirst, pLast] out of another list (or this one), inserting it after pPos; a null pPos inserts at the front
+    void Splice(IListItem* pPos, IntrusiveList& other, gsl::not_null<IListItem*> pFirst, gsl::not_null<IListItem*> pLast, size_t count = UnknownSize);
+
+    // Move all of another list onto the end of this one
+    void SpliceBack(IntrusiveList& other);
+
+    // Unlink [pFirst, pLast] and hand every item back to its pool in one pass
+    void FreeRange(gsl::not_null<IListItem*> pFirst, gsl::not_null<IListItem*> pLast, size_t count = UnknownSize);
+    void FreeAll();
+
+    // Forget the items without touching them; i.e. when their pool has been cleared
+    void Reset();
+
+    template <class T>
+    ListRange<T> Items() const;
+
+private:
+    void LinkChain(IListItem* pPos, IListItem* pFirst, IListItem* pLast, size_t count);
+
+private:
+    IListItem* m_pFront = nullptr;
+    IListItem* m_pBack = nullptr;
+    mutable size_t m_size = 0;
+};
+
+// Something which sews a pool's items into its own structures, and so must unlink them when they are freed
+struct IListOwner
+{
+    // Returns the item which followed the unlinked one, if any
+    virtual IListItem* Unlink(gsl::not_null<IListItem*> pItem) = 0;
+};
+
 struct IMemoryPool
 {
+    virtual ~IMemoryPool() = default;
     virtual void Free(void* pEv) = 0;
-    
-    IListItem* m_pRoot = nullptr;
-    IListItem* m_pLast = nullptr;
+    virtual PoolStats GetStats() const = 0;
+
+    // The pool's own list, used by the list_ functions below
+    IntrusiveList m_list;
 
+    // If set, the owner does the unlinking in list_disconnect instead of m_list
+    IListOwner* m_pOwner = nullptr;
 };
 
+// Named pools can be listed at runtime, i.e. by the profiler window.
+// Pools must unregister at the start of their destructor, while GetStats still works.
+void pool_register(IMemoryPool* pPool, const char* pszName);
+void pool_unregister(IMemoryPool* pPool);
+void pool_visit_stats(const std::function<void(const char*, const PoolStats&)>& fnVisit);
+
 #define DECLARE_POOL_ITEM(className)                 \
     static ctti::type_id_t TypeID()                  \
     {                                                \
@@ -49,7 +152,105 @@ struct IListItem
     IListItem* m_pPrevious = nullptr;
 };
 
-IListItem* list_disconnect(gsl::not_null<IListItem*> pEvent);
+// Typed walk over [pFirst, pLast] of a chain, i.e. for (auto pEvent : list.Items<TimeLineEvent>())
+template <class T>
+class ListRange
+{
+public:
+    class iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T*;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T**;
+        using reference = T*;
+
+        iterator(IListItem* pItem, IListItem* pEnd)
+            : m_pItem(pItem)
+            , m_pEnd(pEnd)
+        {
+        }
+
+        T* operator*() const
+        {
+            return static_cast<T*>(m_pItem);
+        }
+
+        iterator& operator++()
+        {
+            m_pItem = (m_pItem == m_pEnd) ? nullptr : m_pItem->m_pNext;
+            return *this;
+        }
+
+        bool operator==(const iterator& rhs) const
+        {
+            return m_pItem == rhs.m_pItem;
+        }
+
+        bool operator!=(const iterator& rhs) const
+        {
+            return m_pItem != rhs.m_pItem;
+        }
+
+    private:
+        IListItem* m_pItem;
+        IListItem* m_pEnd;
+    };
+
+    ListRange() = default;
+    ListRange(IListItem* pFirst, IListItem* pLast, size_t count)
+        : m_pFirst(pFirst)
+        , m_pLast(pLast)
+        , m_count(count)
+    {
+    }
+
+    iterator begin() const
+    {
+        return iterator(m_pFirst, m_pLast);
+    }
+
+    iterator end() const
+    {
+        return iterator(nullptr, nullptr);
+    }
+
+    T* First() const
+    {
+        return static_cast<T*>(m_pFirst);
+    }
+
+    T* Last() const
+    {
+        return static_cast<T*>(m_pLast);
+    }
+
+    size_t Size() const
+    {
+        return m_count;
+    }
+
+    bool Empty() const
+    {
+        return m_pFirst == nullptr;
+    }
+
+private:
+    IListItem* m_pFirst = nullptr;
+    IListItem* m_pLast = nullptr;
+    size_t m_count = 0;
+};
+
+template <class T>
+ListRange<T> IntrusiveList::Items() const
+{
+    return ListRange<T>(m_pFront, m_pBack, Size());
+}
+
+// These operate on the owning pool's list, when the item has a pool.
+// list_root and list_end walk the chain, as does list_disconnect_range when given a null end;
+// prefer IntrusiveList::Front/Back and EraseRange, which are O(1)
 IListItem* list_root(gsl::not_null<IListItem*> pEvent);
 void list_insert_after(IListItem* pPos, gsl::not_null<IListItem*> pInsert);
 void list_insert_before(IListItem* pPos, gsl::not_null<IListItem*> pInsert);
@@ -70,7 +271,8 @@ public:
 
     virtual void Free()
     {
-        // When freed, disonnect from the chain we are in
+        // When freed, disonnect from the chain we are in.
+        // Items which have been moved into some other IntrusiveList must be freed through that list instead
         list_disconnect(gsl::not_null<IListItem*>(this));
 
         // And return to the pool
@@ -83,48 +285,181 @@ public:
     uint64_t m_id = (uint64_t)-1;
 };
 
-// Thread safe memory pool
+// Pools grow by whole slabs of items instead of one 'new' per item
+static const uint32_t PoolSlabItems = 256;
+static const size_t PoolCacheLineSize = 64;
+
+// Threads which use a thread safe pool get a slot, which indexes their magazine of free items
+static const uint32_t PoolMaxThreadSlots = 64;
+static const uint32_t PoolMagazineSize = 32;
+static const uint32_t PoolInvalidSlot = 0xFFFFFFFF;
+
+// This thread's pool slot, or PoolInvalidSlot if they are all taken.
+// A slot is handed back for reuse when its thread exits.
+uint32_t pool_thread_slot();
+
+// Contiguous, cache line aligned storage for pool items.
+// Items are placement constructed when a slab is added, and are only destroyed when the
+// whole slab set is released; so an item's memory is recycled, never returned to the heap.
+// Not thread safe; the owning pool serializes access.
+template <class T>
+class PoolSlabs
+{
+public:
+    ~PoolSlabs()
+    {
+        Release();
+    }
+
+    // Add a slab of count items, returning the first one
+    T* Grow(IMemoryPool* pPool, uint32_t count)
+    {
+        static_assert(alignof(T) <= PoolCacheLineSize, "Pool item alignment is larger than a cache line");
+        assert(count > 0);
+
+        auto pItems = static_cast<T*>(::operator new(sizeof(T) * count, std::align_val_t(PoolCacheLineSize)));
+        for (uint32_t i = 0; i < count; i++)
+        {
+            new (&pItems[i]) T(pPool, (uint64_t)-1);
+        }
+
+        m_slabs.push_back(Slab{ pItems, count });
+        m_itemCount.store(m_itemCount.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+        return pItems;
+    }
+
+    // Destroy every item in every slab, and release the memory in one go
+    void Release()
+    {
+        for (auto& slab : m_slabs)
+        {
+            for (uint32_t i = 0; i < slab.count; i++)
+            {
+                slab.pItems[i].~T();
+            }
+            ::operator delete(slab.pItems, std::align_val_t(PoolCacheLineSize));
+        }
+        m_slabs.clear();
+        m_itemCount.store(0, std::memory_order_relaxed);
+    }
+
+    // Safe to read from any thread
+    uint64_t ItemCount() const
+    {
+        return m_itemCount.load(std::memory_order_relaxed);
+    }
+
+    uint64_t BytesReserved() const
+    {
+        return ItemCount() * sizeof(T);
+    }
+
+private:
+    struct Slab
+    {
+        T* pItems;
+        uint32_t count;
+    };
+    std::vector<Slab> m_slabs;
+    std::atomic<uint64_t> m_itemCount = 0;
+};
+
+// Single writer counter; avoids a locked read-modify-write on the hot path
+inline void pool_counter_add(std::atomic<uint64_t>& counter, uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+inline void pool_update_peak(std::atomic<uint64_t>& peak, uint64_t value)
+{
+    auto current = peak.load(std::memory_order_relaxed);
+    while (value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+// Thread safe memory pool.
+// Each thread keeps a small magazine of free items, and only touches the shared depot
+// queue to swap half a magazine at a time; so most Alloc/Free calls are uncontended.
+// The alloc/free counters live in the magazines too, and are summed by GetStats; so the peak live
+// count is sampled when the pool grows or the stats are read, rather than on every Alloc.
 template <class T>
 class TSMemoryPool : public IMemoryPool
 {
     static_assert(std::is_base_of<PoolItem, T>::value, "T is not derived from PoolItem");
 
 public:
-    TSMemoryPool(uint32_t initialSize)
+    TSMemoryPool(uint32_t initialSize, uint32_t slabItems = PoolSlabItems)
+        : m_magazines(new Magazine[PoolMaxThreadSlots])
+        , m_slabItems(slabItems)
     {
-        for (uint32_t i = 0; i < initialSize; i++)
+        if (initialSize > 0)
         {
-            m_freeItems.enqueue(Alloc());
+            m_freeItems.enqueue(AddSlab(initialSize));
         }
     }
 
     ~TSMemoryPool()
     {
+        // Before anything goes, so a stats visit never sees a half destroyed pool
+        pool_unregister(this);
         Clear();
     }
 
+    // Destroys every item the pool has made, including any still in use; not thread safe
     void Clear()
     {
-        // Final delete of free items
         T* pVictim = nullptr;
         while (m_freeItems.try_dequeue(pVictim))
         {
-            delete pVictim;
         }
+        for (uint32_t i = 0; i < PoolMaxThreadSlots; i++)
+        {
+            auto& magazine = m_magazines[i];
+            magazine.count = 0;
+            magazine.allocs.store(0, std::memory_order_relaxed);
+            magazine.frees.store(0, std::memory_order_relaxed);
+        }
+        m_sharedAllocs.store(0, std::memory_order_relaxed);
+        m_sharedFrees.store(0, std::memory_order_relaxed);
+        m_misses.store(0, std::memory_order_relaxed);
+        m_peakLive.store(0, std::memory_order_relaxed);
+        m_slabs.Release();
+        m_list.Reset();
     }
 
     T* Alloc()
     {
         T* pRet = nullptr;
 
-        if (!m_freeItems.try_dequeue(pRet))
+        auto slot = pool_thread_slot();
+        if (slot != PoolInvalidSlot)
         {
-            pRet = new T(this, m_nextId++);
+            auto& magazine = m_magazines[slot];
+            if (magazine.count == 0)
+            {
+                // Reload from the depot
+                magazine.count = uint32_t(m_freeItems.try_dequeue_bulk(magazine.items, PoolMagazineSize / 2));
+            }
+
+            if (magazine.count > 0)
+            {
+                pRet = magazine.items[--magazine.count];
+            }
+            pool_counter_add(magazine.allocs, 1);
         }
         else
         {
-            pRet->m_id = m_nextId++;
+            m_freeItems.try_dequeue(pRet);
+            m_sharedAllocs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if (pRet == nullptr)
+        {
+            pRet = Grow();
         }
+
+        pRet->m_id = m_nextId.fetch_add(1, std::memory_order_relaxed);
         pRet->Init();
         return pRet;
     }
@@ -133,12 +468,103 @@ public:
     {
         // store the free item for later
         auto pTyped = (T*)pVal;
-        m_freeItems.enqueue(pTyped);
+
+        auto slot = pool_thread_slot();
+        if (slot == PoolInvalidSlot)
+        {
+            m_freeItems.enqueue(pTyped);
+            m_sharedFrees.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        auto& magazine = m_magazines[slot];
+        pool_counter_add(magazine.frees, 1);
+        if (magazine.count == PoolMagazineSize)
+        {
+            // Full; return the oldest half to the depot, keeping the recently used items
+            const auto half = PoolMagazineSize / 2;
+            m_freeItems.enqueue_bulk(magazine.items, half);
+            memmove(magazine.items, magazine.items + half, sizeof(T*) * half);
+            magazine.count = half;
+        }
+        magazine.items[magazine.count++] = pTyped;
+    }
+
+    PoolStats GetStats() const override
+    {
+        PoolStats stats;
+        stats.liveItems = LiveItems();
+        stats.bytesReserved = m_slabs.BytesReserved();
+        stats.freeItems = m_slabs.ItemCount() > stats.liveItems ? m_slabs.ItemCount() - stats.liveItems : 0;
+        stats.misses = m_misses.load(std::memory_order_relaxed);
+
+        pool_update_peak(m_peakLive, stats.liveItems);
+        stats.peakLiveItems = m_peakLive.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    T* Grow()
+    {
+        std::lock_guard<std::mutex> lock(m_slabMutex);
+
+        // Another thread may have grown the pool while we waited
+        T* pRet = nullptr;
+        if (m_freeItems.try_dequeue(pRet))
+        {
+            return pRet;
+        }
+
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        pool_update_peak(m_peakLive, LiveItems());
+        return AddSlab(m_slabItems);
+    }
+
+    uint64_t LiveItems() const
+    {
+        // Items can be freed on a different thread to the one which made them, so sum signed
+        int64_t live = int64_t(m_sharedAllocs.load(std::memory_order_relaxed)) - int64_t(m_sharedFrees.load(std::memory_order_relaxed));
+        for (uint32_t i = 0; i < PoolMaxThreadSlots; i++)
+        {
+            auto& magazine = m_magazines[i];
+            live += int64_t(magazine.allocs.load(std::memory_order_relaxed)) - int64_t(magazine.frees.load(std::memory_order_relaxed));
+        }
+        return live > 0 ? uint64_t(live) : 0;
+    }
+
+    // Returns the first item of the new slab, and frees the rest
+    T* AddSlab(uint32_t count)
+    {
+        auto pItems = m_slabs.Grow(this, count);
+        for (uint32_t i = 1; i < count; i++)
+        {
+            m_freeItems.enqueue(&pItems[i]);
+        }
+        return pItems;
     }
 
 private:
+    // Only ever touched by the thread which owns the slot
+    struct alignas(PoolCacheLineSize) Magazine
+    {
+        uint32_t count = 0;
+        T* items[PoolMagazineSize];
+        std::atomic<uint64_t> allocs = 0;
+        std::atomic<uint64_t> frees = 0;
+    };
+
     moodycamel::ConcurrentQueue<T*> m_freeItems;
-    uint64_t m_nextId = 0;
+    std::unique_ptr<Magazine[]> m_magazines;
+    PoolSlabs<T> m_slabs;
+    std::mutex m_slabMutex;
+    uint32_t m_slabItems;
+    std::atomic<uint64_t> m_nextId = 0;
+
+    // Stats for threads without a magazine, and for the slow path
+    std::atomic<uint64_t> m_sharedAllocs = 0;
+    std::atomic<uint64_t> m_sharedFrees = 0;
+    std::atomic<uint64_t> m_misses = 0;
+    mutable std::atomic<uint64_t> m_peakLive = 0;
 };
 
 // Memory pool, not thread safe
@@ -148,42 +574,52 @@ class MemoryPool : public IMemoryPool
     static_assert(std::is_base_of<PoolItem, T>::value, "T is not derived from PoolItem");
 
 public:
-    MemoryPool(uint32_t initialSize)
+    MemoryPool(uint32_t initialSize, uint32_t slabItems = PoolSlabItems)
+        : m_slabItems(slabItems)
     {
-        for (uint32_t i = 0; i < initialSize; i++)
+        if (initialSize > 0)
         {
-            m_freeItems.emplace_back(Alloc());
+            AddSlab(initialSize);
         }
     }
 
     ~MemoryPool()
     {
+        // Before anything goes, so a stats visit never sees a half destroyed pool
+        pool_unregister(this);
         Clear();
     }
 
+    // Destroys every item the pool has made, including any still in use
     void Clear()
     {
-        // Final delete of free items
-        for (auto& pVictim : m_freeItems)
-        {
-            delete pVictim;
-        }
+        m_freeItems.clear();
+        m_live.store(0, std::memory_order_relaxed);
+        m_peakLive.store(0, std::memory_order_relaxed);
+        m_misses.store(0, std::memory_order_relaxed);
+        m_slabs.Release();
+        m_list.Reset();
     }
 
     T* Alloc()
     {
-        T* pRet = nullptr;
         if (m_freeItems.empty())
         {
-            pRet = new T(this, m_nextId++);
+            pool_counter_add(m_misses, 1);
+            AddSlab(m_slabItems);
         }
-        else
-        {
-            pRet = m_freeItems.back();
-            m_freeItems.pop_back();
 
-            pRet->m_id = m_nextId++;
+        T* pRet = m_freeItems.back();
+        m_freeItems.pop_back();
+
+        auto live = m_live.load(std::memory_order_relaxed) + 1;
+        m_live.store(live, std::memory_order_relaxed);
+        if (live > m_peakLive.load(std::memory_order_relaxed))
+        {
+            m_peakLive.store(live, std::memory_order_relaxed);
         }
+
+        pRet->m_id = m_nextId++;
         pRet->Init();
         return pRet;
     }
@@ -193,11 +629,42 @@ public:
         // store the free item for later
         auto pTyped = (T*)pVal;
         m_freeItems.push_back(pTyped);
+        m_live.store(m_live.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    }
+
+    PoolStats GetStats() const override
+    {
+        PoolStats stats;
+        stats.liveItems = m_live.load(std::memory_order_relaxed);
+        stats.freeItems = m_slabs.ItemCount() - stats.liveItems;
+        stats.peakLiveItems = m_peakLive.load(std::memory_order_relaxed);
+        stats.misses = m_misses.load(std::memory_order_relaxed);
+        stats.bytesReserved = m_slabs.BytesReserved();
+        return stats;
+    }
+
+private:
+    void AddSlab(uint32_t count)
+    {
+        auto pItems = m_slabs.Grow(this, count);
+
+        // Reversed, so that items are handed out in memory order
+        for (uint32_t i = count; i > 0; i--)
+        {
+            m_freeItems.push_back(&pItems[i - 1]);
+        }
     }
 
 private:
     std::vector<T*> m_freeItems;
+    PoolSlabs<T> m_slabs;
+    uint32_t m_slabItems;
     uint64_t m_nextId = 0;
+
+    // Only written by the owning thread, but can be read from others
+    std::atomic<uint64_t> m_live = 0;
+    std::atomic<uint64_t> m_peakLive = 0;
+    std::atomic<uint64_t> m_misses = 0;
 };
 
 }; // namespace MUtils
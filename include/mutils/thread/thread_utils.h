@@ -3,9 +3,12 @@
 #include <array>
 #include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <emmintrin.h>
 #include <future>
 #include <thread>
+#include <type_traits>
 
 namespace MUtils
 {
@@ -84,4 +87,68 @@ private:
     std::atomic_flag flag = ATOMIC_FLAG_INIT;
 };
 
+// A value which readers copy without blocking the writer; they retry if a write lands while they read.
+// One writer at a time. The value is kept as atomic words, so the racing reads are well defined
+template <typename T>
+class seqlock
+{
+    static_assert(std::is_trivially_copyable<T>::value, "seqlock values are copied as raw words");
+
+public:
+    seqlock(const T& value = T())
+    {
+        store(value);
+    }
+
+    T load() const noexcept
+    {
+        Words words;
+        uint32_t before;
+        uint32_t after;
+        for (;;)
+        {
+            before = m_sequence.load(std::memory_order_acquire);
+            for (size_t i = 0; i < WordCount; i++)
+            {
+                words[i] = m_words[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = m_sequence.load(std::memory_order_relaxed);
+
+            // Odd while a write is in progress
+            if (before == after && (before & 1) == 0)
+            {
+                break;
+            }
+            _mm_pause();
+        }
+
+        T value;
+        memcpy(static_cast<void*>(&value), words.data(), sizeof(T));
+        return value;
+    }
+
+    void store(const T& value) noexcept
+    {
+        Words words = {};
+        memcpy(words.data(), &value, sizeof(T));
+
+        auto sequence = m_sequence.load(std::memory_order_relaxed);
+        m_sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < WordCount; i++)
+        {
+            m_words[i].store(words[i], std::memory_order_relaxed);
+        }
+        m_sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+private:
+    static constexpr size_t WordCount = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    using Words = std::array<uint64_t, WordCount>;
+
+    std::atomic<uint32_t> m_sequence = 0;
+    std::array<std::atomic<uint64_t>, WordCount> m_words;
+};
+
 } // namespace MUtils
@@ -1,29 +1,88 @@
 #pragma once
 
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 #include <mutils/time/timer.h>
 #include <mutils/math/math.h>
 #include <mutils/ui/theme.h>
 
+// The PROFILE_ macros feed the profiler below by default.
+// Build with MUTILS_PROFILER_TRACY to send them to Tracy instead, or MUTILS_PROFILER_NONE to compile them out
+#ifdef MUTILS_PROFILER_TRACY
+#include <tracy/Tracy.hpp>
+#endif
+
 namespace MUtils
 {
 
 namespace Profiler
 {
 
-struct ProfilerEntry
+// The theme's unique colors, packed ARGB, so a zone's color can be picked at compile time
+constexpr uint32_t ZonePalette[] = {
+    0xFFA064C8, 0xFF64C883, 0xFFC86664, 0xFF647EC8, 0xFF9BC864, 0xFFC864B9, 0xFF64C8B9, 0xFFC89C64,
+    0xFF7F64C8, 0xFF65C864, 0xFFC86482, 0xFF64A0C8, 0xFFBDC864, 0xFFB564C8, 0xFF64C898, 0xFFC87B64
+};
+
+// FNV-1a
+constexpr uint32_t ZoneNameHash(const char* pszName, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ uint8_t(pszName[i])) * 16777619u;
+    }
+    return hash;
+}
+
+constexpr uint32_t ZoneColor(const char* pszName, size_t len)
+{
+    return ZonePalette[ZoneNameHash(pszName, len) % (sizeof(ZonePalette) / sizeof(ZonePalette[0]))];
+}
+
+enum LocationFlags : uint32_t
+{
+    LocationFlag_None = 0,
+    LocationFlag_Lock = 1 // Waiting on a lock; see LOCK_GUARD
+};
+
+// The static part of a zone; the macros keep one of these at each call site.
+// It is given an id the first time it is used, and zones refer to it by that
+struct SourceLocation
 {
-    // static infos
     const char* szSection;
     const char* szFile;
     int line;
-    unsigned int color;
-    // infos used for rendering infos
-    int level = 0;
+    uint32_t color;
+    uint32_t flags = LocationFlag_None;
+    std::atomic<uint32_t> id = 0;
+};
+
+// Id 0 is an 'Unknown' location, used if the table fills up
+uint32_t InternLocation(SourceLocation& location);
+const SourceLocation& GetLocation(uint32_t id);
+
+// A recorded zone. Durations which don't fit (or zones still open) are LongDuration,
+// with the end time, if any, in ThreadData::longEnds
+struct ProfilerEntry
+{
+    static const uint32_t LongDuration = 0xFFFFFFFF;
+
+    uint32_t location : 24;
+    uint32_t level : 8;
+    uint32_t duration;
     int64_t startTime;
-    int64_t endTime;
-    uint32_t parent;
 };
+static_assert(sizeof(ProfilerEntry) == 16, "Keep entries small");
 
 struct FrameThreadInfo
 {
@@ -44,6 +103,15 @@ struct Frame : Region
     std::vector<FrameThreadInfo> frameThreads;
 };
 
+// An allocation or free on a profiled thread; the size is saturated to 32 bits
+struct AllocationMarker
+{
+    int64_t time;
+    uint32_t size;
+    uint16_t level;
+    bool free;
+};
+
 struct ThreadData
 {
     bool initialized;
@@ -56,15 +124,113 @@ struct ThreadData
     std::string name;
     std::vector<ProfilerEntry> entries;
     std::vector<uint32_t> entryStack;
+    std::vector<int64_t> childTimeStack;
+    std::unordered_map<uint32_t, int64_t> longEnds;
+    std::vector<AllocationMarker> allocations;
+};
+
+// Totals for the zones at one source location, over everything collected since the profile started.
+// Times are in nanoseconds; exclusive time leaves out the zones inside, and the percentiles are approximate.
+// Allocations are those made directly in the zone, when allocation tracking is on
+struct ZoneStats
+{
+    uint32_t location = 0;
+    uint64_t count = 0;
+    int64_t inclusiveTime = 0;
+    int64_t exclusiveTime = 0;
+    int64_t minTime = 0;
+    int64_t maxTime = 0;
+    int64_t p50 = 0;
+    int64_t p99 = 0;
+    uint64_t allocations = 0;
+    uint64_t allocatedBytes = 0;
+};
+
+// Contention counters for one LOCK_GUARD; the macro keeps one beside its location.
+// Updated by the locking thread with relaxed atomics, so a report is only roughly consistent.
+// Times are in ticks
+struct LockSite
+{
+    SourceLocation* pLocation;
+    std::atomic<uint64_t> acquisitions = 0;
+    std::atomic<uint64_t> contended = 0;
+    std::atomic<uint64_t> waitTicks = 0;
+    std::atomic<uint64_t> maxWaitTicks = 0;
+    std::atomic<uint64_t> holdTicks = 0;
+    std::atomic<uint64_t> maxHoldTicks = 0;
+    std::atomic<bool> registered = false;
+    LockSite* pNext = nullptr;
+};
+
+// A lock is contended when try_lock fails, and waits are only counted then. Times are in nanoseconds
+struct LockStats
+{
+    const SourceLocation* location = nullptr;
+    uint64_t count = 0;
+    uint64_t contended = 0;
+    int64_t totalWait = 0;
+    int64_t maxWait = 0;
+    int64_t totalHold = 0;
+    int64_t maxHold = 0;
+};
+
+struct RegionStats
+{
+    std::string name;
+    uint64_t count = 0;
+    uint64_t overruns = 0;
+    int64_t budget = 0;
+    int64_t maxTime = 0;
 };
 
 void Init(uint32_t maxEntries);
+
+// When the capture buffers fill, drop the oldest data instead of pausing
+void SetContinuousCapture(bool continuous);
+
+// Visit the data collected for each thread, under the lock the collector takes
+void VisitThreads(const std::function<void(const ThreadData&)>& fnVisit);
+
+// Stream the capture to a file as it is recorded, in continuous mode.
+// Loading a capture pauses the profiler and shows the capture instead, until it is resumed
+bool BeginCapture(const char* pszPath);
+void EndCapture();
+bool LoadCapture(const char* pszPath);
+
+// Stats for every location seen, with the highest inclusive time first
+std::vector<ZoneStats> GetZoneStats();
+void ResetZoneStats();
+
+// Allocations are only recorded on threads which have already recorded a zone, so the hooks never create a thread's buffers.
+// Building with MUTILS_PROFILER_ALLOCATIONS replaces the global operator new/delete and hooks stl_allocator; otherwise call these directly
+void SetAllocationTracking(bool track);
+void RecordAllocation(size_t size);
+void RecordFree(size_t size);
+
+// Every lock site used so far, with the most total wait first; maxCount keeps the worst
+std::vector<LockStats> GetLockStats(size_t maxCount = std::numeric_limits<size_t>::max());
+void ResetLockStats();
+void DumpLockStats(size_t maxCount = 10, FILE* pFile = stdout);
+void RegisterLockSite(LockSite& site);
+
+// Write what the profiler is showing as Chrome trace event JSON (chrome://tracing, Perfetto).
+// Threads are tracks, with frames and regions on tracks of their own; lock waits have the 'lock' category
+bool ExportChromeTrace(const char* pszPath);
+
 void NewFrame();
 void NameThread(const char* pszName);
+// Region tracks time a periodic loop, such as an audio callback, against a budget in nanoseconds.
+// Tracks are named by their location's section, and overruns are highlighted and counted.
+// The calls without a location use a default "Region" track, which SetRegionLimit budgets
 void BeginRegion();
 void EndRegion();
+void BeginRegion(SourceLocation& location);
+void EndRegion(SourceLocation& location);
 void SetRegionLimit(uint64_t maxTimeNs);
-void PushSectionBase(const char*, uint32_t, const char*, int);
+void SetRegionBudget(const char* pszName, uint64_t budgetNs);
+std::vector<RegionStats> GetRegionStats();
+void PushSection(SourceLocation& location);
+void PushSectionBase(const char*, uint32_t, const char*, int, uint32_t flags = LocationFlag_None);
 void PopSection();
 void ImGuiLogger(bool* opened);
 void ShowProfile();
@@ -73,6 +239,10 @@ void Finish();
 
 struct ProfileScope
 {
+    ProfileScope(SourceLocation& location)
+    {
+        PushSection(location);
+    }
     ProfileScope(const char* szSection, uint32_t color, const char* szFile, int line)
     {
         PushSectionBase(szSection, color, szFile, line);
@@ -89,10 +259,23 @@ struct RegionScope
     {
         BeginRegion();
     }
+    RegionScope(SourceLocation& location)
+        : m_pLocation(&location)
+    {
+        BeginRegion(location);
+    }
     ~RegionScope()
     {
-        EndRegion();
+        if (m_pLocation)
+        {
+            EndRegion(*m_pLocation);
+        }
+        else
+        {
+            EndRegion();
+        }
     }
+    SourceLocation* m_pLocation = nullptr;
 };
 #define PROFILE_COL_LOCK 0xFF0000FF
 
@@ -102,14 +285,49 @@ public:
     using mutex_type = _Mutex;
 
     explicit profile_lock_guard(_Mutex& _Mtx, const char* name = "Mutex", const char* szFile = nullptr, int line = 0) : _MyMutex(_Mtx) { // construct and lock
-        PushSectionBase(name, PROFILE_COL_LOCK, szFile, line);
+        PushSectionBase(name, PROFILE_COL_LOCK, szFile, line, LocationFlag_Lock);
         _MyMutex.lock();
         PopSection();
     }
 
+    profile_lock_guard(_Mutex& _Mtx, SourceLocation& location) : _MyMutex(_Mtx) { // construct and lock
+        PushSection(location);
+        _MyMutex.lock();
+        PopSection();
+    }
+
+    // Counts contention at the site, and only shows a lock zone when the lock was not free
+    profile_lock_guard(_Mutex& _Mtx, SourceLocation& location, LockSite& site) : _MyMutex(_Mtx), _MySite(&site) { // construct and lock
+        if (!site.registered.load(std::memory_order_relaxed)) {
+            RegisterLockSite(site);
+        }
+
+        if (_MyMutex.try_lock()) {
+            _MyLockedTicks = timer_get_ticks();
+        }
+        else {
+            auto start = timer_get_ticks();
+            PushSection(location);
+            _MyMutex.lock();
+            PopSection();
+            _MyLockedTicks = timer_get_ticks();
+
+            auto wait = _MyLockedTicks - start;
+            site.contended.fetch_add(1, std::memory_order_relaxed);
+            site.waitTicks.fetch_add(wait, std::memory_order_relaxed);
+            UpdateMax(site.maxWaitTicks, wait);
+        }
+        site.acquisitions.fetch_add(1, std::memory_order_relaxed);
+    }
+
     profile_lock_guard(_Mutex& _Mtx, std::adopt_lock_t) : _MyMutex(_Mtx) {} // construct but don't lock
 
     ~profile_lock_guard() noexcept {
+        if (_MySite) {
+            auto hold = timer_get_ticks() - _MyLockedTicks;
+            _MySite->holdTicks.fetch_add(hold, std::memory_order_relaxed);
+            UpdateMax(_MySite->maxHoldTicks, hold);
+        }
         _MyMutex.unlock();
     }
 
@@ -117,25 +335,93 @@ public:
     profile_lock_guard& operator=(const profile_lock_guard&) = delete;
 
 private:
+    static void UpdateMax(std::atomic<uint64_t>& value, uint64_t candidate) {
+        auto current = value.load(std::memory_order_relaxed);
+        while (candidate > current && !value.compare_exchange_weak(current, candidate, std::memory_order_relaxed)) {
+        }
+    }
+
     _Mutex& _MyMutex;
+    LockSite* _MySite = nullptr;
+    uint64_t _MyLockedTicks = 0;
 };
 
-#define LOCK_GUARD(var, name) \
-::MUtils::Profiler::profile_lock_guard name##_lock(var, #name, __FILE__, __LINE__)
-
+#ifdef MUTILS_PROFILER_TRACY
+// Frame marks take the name by pointer, so each region keeps its own
+struct TracyRegionScope
+{
+    TracyRegionScope(const char* pszName)
+        : m_pszName(pszName)
+    {
+        FrameMarkStart(m_pszName);
+    }
+    ~TracyRegionScope()
+    {
+        FrameMarkEnd(m_pszName);
+    }
+    const char* m_pszName;
+};
+#endif
 
 } // namespace Profiler
 } // namespace MUtils
 
+// Declare a mutex which LOCK_GUARD can report on; Tracy only sees locks on its own wrapper
+#if defined(MUTILS_PROFILER_TRACY)
+#define PROFILE_MUTEX(type, var) TracyLockableN(type, var, #var)
+#define LOCK_GUARD(var, name) \
+std::lock_guard<std::decay_t<decltype(var)>> name##_lock(var)
+#elif defined(MUTILS_PROFILER_NONE)
+#define PROFILE_MUTEX(type, var) type var
+#define LOCK_GUARD(var, name) \
+std::lock_guard<std::decay_t<decltype(var)>> name##_lock(var)
+#else
+#define PROFILE_MUTEX(type, var) type var
+#define LOCK_GUARD(var, name) \
+static ::MUtils::Profiler::SourceLocation name##_location{ #name, __FILE__, __LINE__, PROFILE_COL_LOCK, ::MUtils::Profiler::LocationFlag_Lock }; \
+static ::MUtils::Profiler::LockSite name##_site{ &name##_location }; \
+::MUtils::Profiler::profile_lock_guard name##_lock(var, name##_location, name##_site)
+#endif
+
+#if defined(MUTILS_PROFILER_TRACY)
+
+// Tracy colors are 0xRRGGBB
 #define PROFILE_SCOPE(name) \
-static const uint32_t name##_color = ToPackedARGB(MUtils::Theme::ThemeManager::ColorFromName(#name, sizeof(#name))); \
-MUtils::Profiler::ProfileScope name##_scope(#name, name##_color, __FILE__, __LINE__);
+ZoneNamedNC(name##_scope, #name, MUtils::Profiler::ZoneColor(#name, sizeof(#name) - 1) & 0xFFFFFF, true);
+
+#define PROFILE_SCOPE_STR(str, col) \
+ZoneNamedC(str_scope, (col) & 0xFFFFFF, true); \
+ZoneNameV(str_scope, str, strlen(str));
+
+#define PROFILE_REGION(name) \
+static const char* const name##_region_name = #name; \
+MUtils::Profiler::TracyRegionScope name##_region(name##_region_name);
+
+#define PROFILE_NAME_THREAD(name) \
+tracy::SetThreadName(#name);
+
+#define PROFILE_HIDE_THREAD()
+
+#elif defined(MUTILS_PROFILER_NONE)
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_SCOPE_STR(str, col)
+#define PROFILE_REGION(name)
+#define PROFILE_NAME_THREAD(name)
+#define PROFILE_HIDE_THREAD()
+
+#else
+
+#define PROFILE_SCOPE(name) \
+static MUtils::Profiler::SourceLocation name##_location{ #name, __FILE__, __LINE__, std::integral_constant<uint32_t, MUtils::Profiler::ZoneColor(#name, sizeof(#name) - 1)>::value }; \
+MUtils::Profiler::ProfileScope name##_scope(name##_location);
 
 #define PROFILE_SCOPE_STR(str, col) \
 MUtils::Profiler::ProfileScope name##_scope(str, col, __FILE__, __LINE__);
 
 #define PROFILE_REGION(name) \
-MUtils::Profiler::RegionScope name##_region;
+static MUtils::Profiler::SourceLocation name##_region_location{ #name, __FILE__, __LINE__, std::integral_constant<uint32_t, MUtils::Profiler::ZoneColor(#name, sizeof(#name) - 1)>::value }; \
+MUtils::Profiler::RegionScope name##_region(name##_region_location);
 
 #define PROFILE_NAME_THREAD(name) \
 MUtils::Profiler::NameThread(#name);
@@ -143,5 +429,4 @@ MUtils::Profiler::NameThread(#name);
 #define PROFILE_HIDE_THREAD() \
 MUtils::Profiler::HideThread();
 
-
-
+#endif
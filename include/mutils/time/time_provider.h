@@ -6,7 +6,6 @@
 #include <map>
 #include <mutex>
 #include <thread>
-#include <unordered_set>
 #include <vector>
 
 #include <mutils/logger/logger.h>
@@ -27,10 +26,85 @@ struct ITimeConsumer
     virtual void Tick() = 0;
 };
 
+// How late the tick thread's ticks were against their schedule, in nanoseconds.
+// Resyncs are the times it fell too far behind and started a new schedule
+struct TickJitter
+{
+    uint64_t ticks = 0;
+    int64_t meanLate = 0;
+    int64_t maxLate = 0;
+    uint64_t resyncs = 0;
+};
+
+// A tempo from a point in time on; times are clock nanoseconds
+struct TempoSegment
+{
+    int64_t time = 0;
+    double beat = 0;
+    double tempo = 120;
+};
+
+// Maps between time, fractional beat and sample frame. It is a value, so a snapshot can do many conversions.
+// The last few tempo changes are kept; lookups walk back from the newest, so they take bounded time,
+// and times before the oldest change use its tempo
+struct TempoMap
+{
+    static const uint32_t MaxSegments = 16;
+
+    TempoSegment segments[MaxSegments];
+    uint32_t count = 1;
+    double sampleRate = 48000.0;
+    int64_t sampleZero = 0;
+
+    double BeatAtTime(TimePoint time) const;
+    TimePoint TimeAtBeat(double beat) const;
+    double TempoAtTime(TimePoint time) const;
+
+    int64_t SampleAtTime(TimePoint time) const;
+    TimePoint TimeAtSample(int64_t sample) const;
+    double BeatAtSample(int64_t sample) const;
+    int64_t SampleAtBeat(double beat) const;
+
+    // Changes at a time replace any after it
+    void SetTempo(TimePoint time, double tempo);
+    void SetBeat(TimePoint time, double beat);
+
+private:
+    const TempoSegment& SegmentAtTime(int64_t time) const;
+    const TempoSegment& SegmentAtBeat(double beat) const;
+    void Append(const TempoSegment& segment);
+};
+
+// Tempo and position, published together so readers never see half of a change.
+// The beat is the tick thread's; the tempo map has the beat at any time
+struct TempoState
+{
+    double tempo = 120;
+    double quantum = 4;
+    double beat = 0;
+    uint32_t frame = 0;
+};
+
+// A clock which only moves when told to; for rendering and testing faster than real time.
+// It never goes backwards
+class VirtualClock
+{
+public:
+    explicit VirtualClock(TimePoint start = std::chrono::high_resolution_clock::now());
+
+    TimePoint Now() const;
+    void Set(TimePoint time);
+    void Advance(std::chrono::nanoseconds duration);
+
+private:
+    std::atomic<int64_t> m_now;
+};
+
 class TimeProvider
 {
 public:
     TimeProvider();
+    ~TimeProvider();
     static TimeProvider& Instance();
 
     void Free();
@@ -38,7 +112,18 @@ public:
     TimePoint Now() const;
     TimePoint StartTime() const;
 
+    // Time comes from the clock instead of the system clock; null goes back to the system clock.
+    // The tick thread follows a virtual clock advanced elsewhere, skipping ahead if it jumps too far
+    void SetClock(VirtualClock* pClock);
+    VirtualClock* GetClock() const;
+
+    // Moves the virtual clock to the time, dispatching each tick on the way on this thread,
+    // as fast as the consumers allow. Needs a virtual clock, and the tick thread stopped
+    void RunUntil(TimePoint time);
+
     void ResetStartTime();
+
+    // The tick thread reads the consumers without a lock; once UnRegisterConsumer returns, the consumer won't be ticked
     void RegisterConsumer(ITimeConsumer* pConsumer);
     void UnRegisterConsumer(ITimeConsumer* pConsumer);
     void StartThread();
@@ -48,29 +133,71 @@ public:
     void SetBeat(double beat);
     void SetFrame(uint32_t frame);
 
+    // Tempo changes at other times; e.g. ahead of the render position
+    void SetTempoAt(TimePoint time, double bpm);
+
+    // Sample frames count from sampleZero at the given rate
+    void SetSampleRate(double sampleRate, TimePoint sampleZero);
+
+    // Ticks per beat of the tick thread (i.e. PPQN); each tick advances the beat by a fraction
+    void SetTicksPerBeat(uint32_t ticksPerBeat);
+    uint32_t GetTicksPerBeat() const;
+
+    // The tick thread sleeps until this close to a tick, then spins; zero just sleeps
+    void SetSpinWindow(std::chrono::microseconds window);
+
+    TickJitter GetTickJitter() const;
+    void ResetTickJitter();
+
+    TempoState GetTempoState() const;
     uint32_t GetFrame() const;
     double GetBeat() const;
     double GetTempo() const;
     double GetQuantum() const;
     std::chrono::microseconds GetTimePerBeat() const;
 
-    double GetBeatAtTime(TimePoint time);
+    // Lock free; audio callbacks can take the map once and convert each event with it
+    TempoMap GetTempoMap() const;
+    double GetBeatAtTime(TimePoint time) const;
+    TimePoint GetTimeAtBeat(double beat) const;
+    int64_t GetSampleAtTime(TimePoint time) const;
+    TimePoint GetTimeAtSample(int64_t sample) const;
+    double GetBeatAtSample(int64_t sample) const;
+    int64_t GetSampleAtBeat(double beat) const;
+
+private:
+    TimePoint WaitForBeat(double beat, uint64_t version) const;
+    bool DispatchTick(int64_t tick, uint32_t ticksPerBeat, uint64_t version);
+    void RecordJitter(int64_t lateNs);
+    void PublishConsumers(std::vector<ITimeConsumer*>* pConsumers);
 
 private:
     TimePoint m_startTime;
-    std::unordered_set<ITimeConsumer*> m_consumers;
-    audio_spin_mutex m_spin_mutex;
+    std::atomic<VirtualClock*> m_pClock = nullptr;
+
+    // Copied on write. The old list is freed once the tick thread can't be reading it;
+    // m_dispatch is odd while the tick thread is walking a list
+    std::atomic<std::vector<ITimeConsumer*>*> m_consumers;
+    std::atomic<uint64_t> m_dispatch = 0;
+    PROFILE_MUTEX(std::mutex, m_consumerMutex);
+
+    // Writers of the tempo state and map take the lock; readers don't
+    seqlock<TempoState> m_state;
+    seqlock<TempoMap> m_tempoMap;
+    PROFILE_MUTEX(audio_spin_mutex, m_spin_mutex);
 
     std::atomic_bool m_quitTimer = false;
     std::thread m_tickThread;
-    std::atomic<double> m_quantum = 4;
-    std::atomic<double> m_tempo = 120;
-    std::atomic<double> m_beat = 0;
-    std::atomic<uint32_t> m_frame = 0;
-
-    TimePoint m_lastTime; // Should probably be atomic, but compile error on GCC?
-    std::atomic<double> m_lastBeat;
-    std::chrono::microseconds m_timePerBeat = std::chrono::microseconds(1000000 / 120);
+    std::atomic<uint32_t> m_ticksPerBeat = 1;
+    std::atomic<int64_t> m_spinWindowNs = 500000;
+
+    // Changed under the lock when the beat jumps, so the tick thread finds its place again
+    std::atomic<uint64_t> m_scheduleVersion = 0;
+
+    std::atomic<uint64_t> m_jitterTicks = 0;
+    std::atomic<int64_t> m_jitterTotal = 0;
+    std::atomic<int64_t> m_jitterMax = 0;
+    std::atomic<uint64_t> m_resyncs = 0;
 };
 
 }; // namespace MUtils
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <cstdint>
+#include <limits>
 #include <map>
 #include <mutex>
 #include <thread>
@@ -26,6 +28,22 @@ namespace MUtils
 
 static const uint32_t TimeLineStorageSpace = 4;
 
+// Skip list levels in the timeline index; with 1 in 4 events promoted per level, this covers ~1M events
+static const uint32_t TimeLineIndexLevels = 10;
+
+// An event's expiry index when it is not in the expiry heap
+static const uint32_t TimeLineNoExpiry = 0xFFFFFFFF;
+
+// Which of the timeline's structures an event is sewn into
+enum class TimeLineLocation : uint8_t
+{
+    None,
+    Staged,
+    Pending,
+    Triggered,
+    Detached
+};
+
 // An event in the time line, stored in a memory pool
 class TimeLineEvent : public MUtils::PoolItem
 {
@@ -56,29 +74,137 @@ public:
     virtual void Init() override
     {
         m_triggered = false;
+        m_location = TimeLineLocation::None;
+        m_lane = 0;
+        m_indexLevels = 0;
+        m_expiryIndex = TimeLineNoExpiry;
     }
 
     TimePoint m_time;
     std::chrono::milliseconds m_duration;
     bool m_triggered = false;
     const char* m_pszName = nullptr;
+
+    // Owned by the Timeline the event is stored in
+    TimeLineLocation m_location = TimeLineLocation::None;
+    uint32_t m_lane = 0;
+    uint32_t m_indexLevels = 0;
+    uint32_t m_expiryIndex = TimeLineNoExpiry;
+    TimeLineEvent* m_pIndexNext[TimeLineIndexLevels - 1];
 };
 
+// A skip list of events, in time order.
+// Level 0 is an IntrusiveList through the events, so it can be walked as normal;
+// the levels above it skip ahead, making insertion and removal O(log n).
+class TimeLineIndex
+{
+public:
+    // Inserted after any events with the same time
+    void Insert(gsl::not_null<TimeLineEvent*> pEvent);
+    void Erase(gsl::not_null<TimeLineEvent*> pEvent);
+
+    // Move the events at or before the time onto the back of another list, in O(log n) plus a pass to count them.
+    // Returns the first event moved (the last is out.Back()) and the count, or null if none are due
+    TimeLineEvent* SpliceDue(TimePoint upTo, IntrusiveList& out, size_t& count);
+
+    // Forget the events without touching them
+    void Reset();
+
+    TimeLineEvent* Front() const
+    {
+        return static_cast<TimeLineEvent*>(m_list.Front());
+    }
+
+    size_t Size() const
+    {
+        return m_list.Size();
+    }
+
+    const IntrusiveList& List() const
+    {
+        return m_list;
+    }
+
+    // Walks the index in time order, and can remove the current event in O(1)
+    class Walker
+    {
+    public:
+        Walker(TimeLineIndex& index);
+
+        TimeLineEvent* Current() const
+        {
+            return m_pCurrent;
+        }
+
+        void Next();
+
+        // Remove the current event, and move on to the one after it
+        void Erase();
+
+    private:
+        TimeLineIndex& m_index;
+        TimeLineEvent* m_pCurrent = nullptr;
+
+        // The last event seen on each level, which links to the current one if it is on that level
+        TimeLineEvent* m_pPrevious[TimeLineIndexLevels];
+    };
+
+private:
+    TimeLineEvent*& NextAt(TimeLineEvent* pEvent, uint32_t level);
+    uint32_t RandomLevels();
+
+private:
+    IntrusiveList m_list;
+    TimeLineEvent* m_pHead[TimeLineIndexLevels - 1] = {};
+    uint32_t m_levels = 1;
+    uint32_t m_seed = 0x9E3779B9;
+};
+
+
+static const uint32_t TimeLineDefaultPoolSize = 1000;
+
+// Staged events are moved into the timeline this many at a time
+static const uint32_t TimeLineMergeBatch = 64;
 
+// Events which have not been dequeued yet are kept in a time index per event type (a lane), so storing
+// is O(log n), and dequeuing a type only touches the due events of that type.
+// Dequeued events move to a triggered list until they expire. Every event is tracked by end time in an expiry heap
+// from when it is merged, so dequeuing never touches the heap, and expiring never walks events which haven't ended.
+// Stored events are staged in a lock free queue, and merged into the lanes by the consumer,
+// so producers never wait on the (audio thread) consumer.
 template <class T>
-class Timeline
+class Timeline : public IListOwner
 {
 public:
-    Timeline()
-        : m_timeEventPool(1000)
+    // Use the pool stats (i.e. in the profiler window) to pick a pool size which covers the peak.
+    // Times are the provider's, so a timeline runs on its (possibly virtual) clock
+    Timeline(uint32_t initialPoolSize = TimeLineDefaultPoolSize, const char* pszName = "Timeline", TimeProvider& provider = TimeProvider::Instance())
+        : m_timeEventPool(initialPoolSize)
+        , m_pTimeProvider(&provider)
     {
-        m_startTime = TimeProvider::Instance().Now();
+        m_startTime = m_pTimeProvider->Now();
+        m_timeEventPool.m_pOwner = this;
+        m_expiry.reserve(initialPoolSize);
+        pool_register(&m_timeEventPool, pszName);
     }
 
+    // The pool points back at us
+    Timeline(const Timeline&) = delete;
+    Timeline& operator=(const Timeline&) = delete;
+
     void Free()
     {
         // Clear the pool
         m_timeEventPool.Clear();
+
+        // Staged events went with the pool
+        T* staged[TimeLineMergeBatch];
+        while (m_staged.try_dequeue_bulk(staged, TimeLineMergeBatch) != 0)
+        {
+        }
+        m_lanes.clear();
+        m_triggered.Reset();
+        m_expiry.clear();
     }
 
     TimePoint StartTime() const
@@ -88,50 +214,49 @@ public:
 
     void ResetStartTime()
     {
-        m_startTime = TimeProvider::Instance().Now();
+        m_startTime = m_pTimeProvider->Now();
     }
 
-    void ExpireEvents(int secondsOld)
+    // Frees events which ended more than secondsOld ago, oldest end first, and at most maxCount of them;
+    // a bounded count keeps the cost per call down, with the rest picked up by later calls.
+    // Returns the number of events freed
+    size_t ExpireEvents(int secondsOld, size_t maxCount = std::numeric_limits<size_t>::max())
     {
         PROFILE_SCOPE(ExpireEvents);
         LOCK_GUARD(m_mutex, Timeline_Lock);
+        MergeStaged();
 
-        auto startTime = TimeProvider::Instance().Now();
+        const auto cutoff = m_pTimeProvider->Now() - std::chrono::seconds(secondsOld);
+        size_t expired = 0;
 
-        auto pCurrent = (T*)m_timeEventPool.m_pRoot;
-        while (pCurrent)
+        // Triggered events, and old ones which nobody dequeued, by end time
+        while (!m_expiry.empty() && expired < maxCount && m_expiry.front().end < cutoff)
         {
-            // TODO: this is broken if the duration is long!
-            // Need to track and remove long events
-            if ((startTime - (pCurrent->m_time + pCurrent->m_duration)) > std::chrono::seconds(secondsOld))
+            auto pEvent = m_expiry.front().pEvent;
+            ExpiryRemove(0);
+            if (pEvent->m_location == TimeLineLocation::Pending)
             {
-                auto pVictim = pCurrent;
-                pCurrent = (T*)list_disconnect(gsl::not_null<IListItem*>(pCurrent));
-                pVictim->Free();
-                continue;
+                m_lanes[pEvent->m_lane].pending.Erase(pEvent);
             }
-            else if ((startTime - pCurrent->m_time) < std::chrono::seconds(16))
+            else
             {
-                break;
+                m_triggered.Erase(pEvent);
             }
-            pCurrent = (T*)pCurrent->m_pNext;
+            FreeEvent(pEvent);
+            expired++;
         }
+        return expired;
     }
 
+    // Safe to call from any number of threads; the event is visible to the next dequeue
     void StoreTimeEvent(T* ev)
     {
-        LOCK_GUARD(m_mutex, Timeline_Lock);
         assert(ev->m_pNext == nullptr);
         assert(ev->m_pPrevious == nullptr);
+        assert(ev->m_location == TimeLineLocation::None);
 
-        // Add on the end, but keep events ordered in time
-        auto pCurrent = (T*)m_timeEventPool.m_pLast;
-        while (pCurrent && (ev->m_time < pCurrent->m_time))
-        {
-            pCurrent = (T*)pCurrent->m_pPrevious;
-        }
-        assert(pCurrent == nullptr || (pCurrent->m_time <= ev->m_time));
-        list_insert_after(pCurrent, gsl::not_null<IListItem*>(ev));
+        ev->m_location = TimeLineLocation::Staged;
+        m_staged.enqueue(ev);
     }
 
     // TODO: Don't think this is necessary any more; since time events have linked lists
@@ -139,65 +264,269 @@ public:
     {
         PROFILE_SCOPE(GetTimeEvents);
         LOCK_GUARD(m_mutex, Timeline_Lock);
+        MergeStaged();
         ev.clear();
 
-        auto pCurrent = m_timeEventPool.m_pRoot;
-        while (pCurrent)
+        for (auto pEvent : m_triggered.Items<T>())
         {
-            ev.push_back((T*)pCurrent);
-            pCurrent = pCurrent->m_pNext;
+            ev.push_back(pEvent);
         }
+
+        for (auto& lane : m_lanes)
+        {
+            for (auto pEvent : lane.pending.List().template Items<T>())
+            {
+                ev.push_back(pEvent);
+            }
+        }
+
+        std::stable_sort(ev.begin(), ev.end(), [](T* lhs, T* rhs) { return lhs->m_time < rhs->m_time; });
     }
 
-    // Returns events before the time, in an array
-    // TODO: Just return links to begin/end?
-    void DequeTimeEvents(std::vector<T*>& ev, ctti::type_id_t type, TimePoint upTo)
+    // Returns the events before the time, in time order, without copying them.
+    // The events stay in the timeline's triggered list, and the range is valid until they are freed or expired
+    ListRange<T> DequeTimeEvents(ctti::type_id_t type, TimePoint upTo)
     {
         PROFILE_SCOPE(DequeTimeEvents);
         LOCK_GUARD(m_mutex, Timeline_Lock);
+        MergeStaged();
+
+        auto laneIndex = FindLane(type, false);
+        if (laneIndex == InvalidLane)
+        {
+            return ListRange<T>();
+        }
+
+        // The lane only holds untriggered events of this type, so the due ones are at the front
+        size_t count = 0;
+        auto pFirst = m_lanes[laneIndex].pending.SpliceDue(upTo, m_triggered, count);
+        if (!pFirst)
+        {
+            return ListRange<T>();
+        }
+
+        for (IListItem* pItem = pFirst; pItem; pItem = pItem->m_pNext)
+        {
+            auto pEvent = static_cast<T*>(pItem);
+            pEvent->m_triggered = true;
+            pEvent->m_location = TimeLineLocation::Triggered;
+        }
+        return ListRange<T>(pFirst, m_triggered.Back(), count);
+    }
+
+    // Returns events before the time, in an array
+    void DequeTimeEvents(std::vector<T*>& ev, ctti::type_id_t type, TimePoint upTo)
+    {
         ev.clear();
+        for (auto pEvent : DequeTimeEvents(type, upTo))
+        {
+            ev.push_back(pEvent);
+        }
+    }
+
+    // Take a dequeued range out of the timeline; i.e. to keep events past their expiry.
+    // The splice is O(1), but the events are marked in one pass so that expiry passes over them.
+    // The events then belong to the list, and must be freed through it (IntrusiveList::FreeAll)
+    void Detach(const ListRange<T>& range, IntrusiveList& out)
+    {
+        if (range.Empty())
+        {
+            return;
+        }
 
-        //LOG(DEBUG) << "T: " << time_to_float_seconds(upTo);
+        LOCK_GUARD(m_mutex, Timeline_Lock);
+        for (auto pEvent : range)
+        {
+            pEvent->m_location = TimeLineLocation::Detached;
+            ExpiryRemove(pEvent->m_expiryIndex);
+        }
+        out.Splice(out.Back(), m_triggered, range.First(), range.Last(), range.Size());
+    }
+
+    // Getters
+    TSMemoryPool<T>& GetEventPool()
+    {
+        return m_timeEventPool;
+    };
 
-        TimePoint last = TimePoint::min();
-        auto pCurrent = (T*)m_timeEventPool.m_pRoot;
-        while (pCurrent)
+private:
+    struct ExpiryEntry
+    {
+        TimePoint end;
+        T* pEvent;
+    };
+
+    // Called when an event we hold is freed with PoolItem::Free
+    IListItem* Unlink(gsl::not_null<IListItem*> pItem) override
+    {
+        LOCK_GUARD(m_mutex, Timeline_Lock);
+        return UnlinkEvent(static_cast<T*>(pItem.get()));
+    }
+
+    IListItem* UnlinkEvent(T* pEvent)
+    {
+        // Can't pull an event out of the middle of the queue, so take them all
+        if (pEvent->m_location == TimeLineLocation::Staged)
         {
-            //LOG(DEBUG) << "E: " << pCurrent->m_time.time_since_epoch().count();
-            if (pCurrent->m_triggered)
+            MergeStaged();
+        }
+
+        IListItem* pNext = pEvent->m_pNext;
+        switch (pEvent->m_location)
+        {
+        case TimeLineLocation::Pending:
+            ExpiryRemove(pEvent->m_expiryIndex);
+            m_lanes[pEvent->m_lane].pending.Erase(pEvent);
+            break;
+        case TimeLineLocation::Triggered:
+            ExpiryRemove(pEvent->m_expiryIndex);
+            m_triggered.Erase(pEvent);
+            break;
+        default:
+            break;
+        }
+        pEvent->m_location = TimeLineLocation::None;
+        return pNext;
+    }
+
+    // Move the staged events into their lanes; called with the lock held
+    void MergeStaged()
+    {
+        T* staged[TimeLineMergeBatch];
+        size_t count;
+        while ((count = m_staged.try_dequeue_bulk(staged, TimeLineMergeBatch)) != 0)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                auto pEvent = staged[i];
+                pEvent->m_lane = FindLane(pEvent->GetType(), true);
+                m_lanes[pEvent->m_lane].pending.Insert(pEvent);
+                pEvent->m_location = TimeLineLocation::Pending;
+                ExpiryPush(pEvent);
+            }
+        }
+    }
+
+    // There are only ever a few event types, so a linear search beats hashing
+    uint32_t FindLane(ctti::type_id_t type, bool create)
+    {
+        const auto hash = type.hash();
+        for (uint32_t i = 0; i < uint32_t(m_lanes.size()); i++)
+        {
+            if (m_lanes[i].typeHash == hash)
             {
-                pCurrent = (T*)pCurrent->m_pNext;
-                continue;
+                return i;
             }
+        }
+
+        if (!create)
+        {
+            return InvalidLane;
+        }
+
+        // Events find their lane by index, so the index may be moved around safely
+        m_lanes.emplace_back();
+        m_lanes.back().typeHash = hash;
+        return uint32_t(m_lanes.size() - 1);
+    }
+
+    // The expiry heap keeps each event's position in it up to date, so an event can be removed when it leaves early
+    void ExpirySet(uint32_t index, const ExpiryEntry& entry)
+    {
+        m_expiry[index] = entry;
+        entry.pEvent->m_expiryIndex = index;
+    }
 
-            if (pCurrent->m_time > upTo)
+    void ExpiryPush(T* pEvent)
+    {
+        m_expiry.push_back(ExpiryEntry{ pEvent->EndTime(), pEvent });
+        ExpirySiftUp(uint32_t(m_expiry.size() - 1));
+    }
+
+    void ExpiryRemove(uint32_t index)
+    {
+        m_expiry[index].pEvent->m_expiryIndex = TimeLineNoExpiry;
+        const auto last = m_expiry.back();
+        m_expiry.pop_back();
+        if (index < m_expiry.size())
+        {
+            ExpirySet(index, last);
+            ExpirySiftUp(index);
+            ExpirySiftDown(m_expiry[index].pEvent->m_expiryIndex);
+        }
+    }
+
+    void ExpirySiftUp(uint32_t index)
+    {
+        const auto entry = m_expiry[index];
+        while (index > 0)
+        {
+            const auto parent = (index - 1) / 2;
+            if (!(m_expiry[parent].end > entry.end))
             {
                 break;
             }
+            ExpirySet(index, m_expiry[parent]);
+            index = parent;
+        }
+        ExpirySet(index, entry);
+    }
 
-            if (pCurrent->GetType() == type)
+    void ExpirySiftDown(uint32_t index)
+    {
+        const auto entry = m_expiry[index];
+        const auto size = uint32_t(m_expiry.size());
+        for (;;)
+        {
+            auto child = index * 2 + 1;
+            if (child >= size)
             {
-                pCurrent->m_triggered = true;
-                ev.push_back(pCurrent);
-                assert(pCurrent->m_time >= last);
-                last = pCurrent->m_time;
-                //event_dump("DQ: ", pCurrent);
+                break;
             }
-            pCurrent = (T*)pCurrent->m_pNext;
+            if (child + 1 < size && m_expiry[child + 1].end < m_expiry[child].end)
+            {
+                child++;
+            }
+            if (!(m_expiry[child].end < entry.end))
+            {
+                break;
+            }
+            ExpirySet(index, m_expiry[child]);
+            index = child;
         }
+        ExpirySet(index, entry);
     }
 
-    // Getters
-    TSMemoryPool<T>& GetEventPool()
+    // For events which are already unlinked; PoolItem::Free would come back to Unlink and the lock
+    void FreeEvent(T* pEvent)
     {
-        return m_timeEventPool;
-    };
+        pEvent->m_location = TimeLineLocation::None;
+        m_timeEventPool.Free(pEvent);
+    }
 
 private:
+    static const uint32_t InvalidLane = 0xFFFFFFFF;
+
+    // Untriggered events of one type
+    struct Lane
+    {
+        uint64_t typeHash = 0;
+        TimeLineIndex pending;
+    };
+
     TimePoint m_startTime;
     TSMemoryPool<T> m_timeEventPool;
+    TimeProvider* m_pTimeProvider;
+    std::vector<Lane> m_lanes;
+    IntrusiveList m_triggered;
+
+    // Pending and triggered events by end time, as a min heap; so it is no bigger than the pool
+    std::vector<ExpiryEntry> m_expiry;
+
+    // Stored, but not yet merged into the lanes
+    moodycamel::ConcurrentQueue<T*> m_staged;
 
-    audio_spin_mutex m_mutex;
+    PROFILE_MUTEX(audio_spin_mutex, m_mutex);
 };
 
 }; // namespace MUtils
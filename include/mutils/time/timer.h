@@ -30,4 +30,13 @@ double timer_get_elapsed_seconds(const timer& timer);
 double timer_to_seconds(uint64_t value);
 double timer_to_ms(uint64_t value);
 
+// Cheap raw timestamps, for the profiler's hot path. These are CPU timestamp counter ticks when built
+// with MUTILS_TIMER_TSC on a CPU with an invariant counter, otherwise steady clock nanoseconds.
+// The first call calibrates the counter, which takes a few milliseconds; call timer_calibrate_ticks up front to
+// pay for that at a convenient time. Convert differences to nanoseconds only when displaying them
+void timer_calibrate_ticks();
+uint64_t timer_get_ticks();
+int64_t timer_ticks_to_ns(int64_t ticks);
+bool timer_ticks_are_tsc();
+
 } // namespace MUtils
@@ -24,13 +24,14 @@ freely, subject to the following restrictions:
 /*
 CM: Note: Modified from the original to support query of the threads available on the machine,
 and fallback to using single threaded if not possible.
+Since reworked as a work stealing pool: each worker has a Chase-Lev deque, tasks are stored
+without allocating where they fit, and idle workers are woken sparingly.
 Original here: https://github.com/progschj/ThreadPool
 */
 #pragma once
 
 // containers
 #include <array>
-#include <queue>
 #include <vector>
 // threading
 #include <atomic>
@@ -41,6 +42,9 @@ Original here: https://github.com/progschj/ThreadPool
 // utility wrappers
 #include <functional>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
 // exceptions
 #include <stdexcept>
 #include <string>
@@ -49,10 +53,287 @@ Original here: https://github.com/progschj/ThreadPool
 #include <concurrentqueue/concurrentqueue.h>
 #include <mutils/thread/thread_utils.h>
 
-// std::thread pool for resources recycling
+namespace tpool_detail
+{
+
+// A move only callable. Those which fit (a lambda with a few captures, a packaged_task) are stored inline,
+// the rest on the heap
+class task
+{
+public:
+    static const size_t InlineSize = 48;
+
+    task() = default;
+
+    template <class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, task>::value>::type>
+    task(F&& f)
+    {
+        using fn_t = typename std::decay<F>::type;
+        if constexpr (sizeof(fn_t) <= InlineSize && alignof(fn_t) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible<fn_t>::value)
+        {
+            new (storage) fn_t(std::forward<F>(f));
+            ops = &inline_ops<fn_t>::table;
+        }
+        else
+        {
+            *reinterpret_cast<fn_t**>(storage) = new fn_t(std::forward<F>(f));
+            ops = &heap_ops<fn_t>::table;
+        }
+    }
+
+    task(task&& rhs) noexcept
+    {
+        if (rhs.ops)
+        {
+            rhs.ops->move(storage, rhs.storage);
+            ops = rhs.ops;
+            rhs.ops = nullptr;
+        }
+    }
+
+    task& operator=(task&& rhs) noexcept
+    {
+        if (this != &rhs)
+        {
+            reset();
+            if (rhs.ops)
+            {
+                rhs.ops->move(storage, rhs.storage);
+                ops = rhs.ops;
+                rhs.ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    ~task()
+    {
+        reset();
+    }
+
+    void operator()()
+    {
+        ops->invoke(storage);
+    }
+
+    explicit operator bool() const
+    {
+        return ops != nullptr;
+    }
+
+    void reset()
+    {
+        if (ops)
+        {
+            ops->destroy(storage);
+            ops = nullptr;
+        }
+    }
+
+private:
+    struct op_table
+    {
+        void (*invoke)(void*);
+        void (*move)(void* dest, void* src);
+        void (*destroy)(void*);
+    };
+
+    template <class F>
+    struct inline_ops
+    {
+        static void invoke(void* p)
+        {
+            (*static_cast<F*>(p))();
+        }
+        static void move(void* dest, void* src)
+        {
+            new (dest) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        }
+        static void destroy(void* p)
+        {
+            static_cast<F*>(p)->~F();
+        }
+        static const op_table table;
+    };
+
+    template <class F>
+    struct heap_ops
+    {
+        static void invoke(void* p)
+        {
+            (**static_cast<F**>(p))();
+        }
+        static void move(void* dest, void* src)
+        {
+            *static_cast<F**>(dest) = *static_cast<F**>(src);
+        }
+        static void destroy(void* p)
+        {
+            delete *static_cast<F**>(p);
+        }
+        static const op_table table;
+    };
+
+    alignas(std::max_align_t) unsigned char storage[InlineSize];
+    const op_table* ops = nullptr;
+};
+
+template <class F>
+const task::op_table task::inline_ops<F>::table = { &task::inline_ops<F>::invoke, &task::inline_ops<F>::move, &task::inline_ops<F>::destroy };
+
+template <class F>
+const task::op_table task::heap_ops<F>::table = { &task::heap_ops<F>::invoke, &task::heap_ops<F>::move, &task::heap_ops<F>::destroy };
+
+// Tasks are queued in nodes, which are recycled rather than freed
+struct task_node
+{
+    task fn;
+    // The count of the group the task was run in, if any
+    std::atomic<size_t>* pending = nullptr;
+};
+
+// Chase-Lev work stealing deque (as in Le et al, 'Correct and Efficient Work-Stealing for Weak Memory Models').
+// The owner pushes and pops at the bottom, thieves take from the top. It grows as needed; the old arrays are
+// kept until the deque goes, since a thief may still be reading one
+class work_deque
+{
+public:
+    explicit work_deque(int64_t capacity = 256)
+    {
+        rings.emplace_back(new ring(capacity));
+        array.store(rings.back().get(), std::memory_order_relaxed);
+    }
+
+    work_deque(const work_deque&) = delete;
+    work_deque& operator=(const work_deque&) = delete;
+
+    // Owner only
+    void push(task_node* node)
+    {
+        const auto b = bottom.load(std::memory_order_relaxed);
+        const auto t = top.load(std::memory_order_acquire);
+        auto a = array.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1)
+        {
+            a = grow(a, t, b);
+        }
+        a->put(b, node);
+        bottom.store(b + 1, std::memory_order_release);
+    }
+
+    // Owner only; newest first
+    task_node* pop()
+    {
+        const auto b = bottom.load(std::memory_order_relaxed) - 1;
+        auto a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_seq_cst);
+        auto t = top.load(std::memory_order_seq_cst);
+
+        if (t > b)
+        {
+            // Empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        auto node = a->get(b);
+        if (t == b)
+        {
+            // The last one; race the thieves for it
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            {
+                node = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return node;
+    }
+
+    // Any thread; oldest first. Null if empty, or another thread got there first
+    task_node* steal()
+    {
+        auto t = top.load(std::memory_order_seq_cst);
+        const auto b = bottom.load(std::memory_order_seq_cst);
+        if (t >= b)
+        {
+            return nullptr;
+        }
+
+        auto node = array.load(std::memory_order_acquire)->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            return nullptr;
+        }
+        return node;
+    }
+
+    bool empty() const
+    {
+        return top.load(std::memory_order_seq_cst) >= bottom.load(std::memory_order_seq_cst);
+    }
+
+private:
+    struct ring
+    {
+        explicit ring(int64_t size)
+            : capacity(size)
+            , slots(new std::atomic<task_node*>[size])
+        {
+        }
+
+        task_node* get(int64_t index) const
+        {
+            return slots[index & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t index, task_node* node)
+        {
+            slots[index & (capacity - 1)].store(node, std::memory_order_relaxed);
+        }
+
+        const int64_t capacity;
+        std::unique_ptr<std::atomic<task_node*>[]> slots;
+    };
+
+    ring* grow(ring* a, int64_t t, int64_t b)
+    {
+        rings.emplace_back(new ring(a->capacity * 2));
+        auto bigger = rings.back().get();
+        for (auto i = t; i < b; i++)
+        {
+            bigger->put(i, a->get(i));
+        }
+        array.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    alignas(64) std::atomic<int64_t> top = { 0 };
+    alignas(64) std::atomic<int64_t> bottom = { 0 };
+    std::atomic<ring*> array;
+    std::vector<std::unique_ptr<ring>> rings;
+};
+
+} // namespace tpool_detail
+
+// std::thread pool for resources recycling.
+// Tasks queued from a worker go on its own deque and run newest first, which keeps the data they
+// touch in its cache; other threads queue to a shared queue. Idle workers steal from the others.
+// Only a couple of idle workers spin looking for work at once, and a sleeping one is only woken
+// when nobody is looking, so a stream of small tasks doesn't wake the whole pool for each one
 class TPool
 {
 public:
+    // Counts the tasks run in it, so a wait covers just those; i.e. one per fork/join.
+    // A task may wait on a group it is not part of, such as one for the tasks it runs itself
+    struct group
+    {
+        std::atomic<size_t> pending = { 0 };
+    };
+
     // the constructor just launches some amount of workers
     TPool(size_t threads_n = std::thread::hardware_concurrency())
         : stop(false)
@@ -60,28 +341,14 @@ public:
         // If not enough threads, the pool will just execute all tasks immediately
         if (threads_n > 1)
         {
+            // The deques are all there before anyone can steal from them
+            this->deques.reserve(threads_n);
+            for (size_t i = 0; i < threads_n; i++)
+                this->deques.emplace_back(new tpool_detail::work_deque());
+
             this->workers.reserve(threads_n);
-            for (; threads_n; --threads_n)
-                this->workers.emplace_back(
-                    [this] {
-                        while (true)
-                        {
-                            std::function<void()> task;
-
-                            {
-                                std::unique_lock<std::mutex> lock(this->queue_mutex);
-                                this->condition.wait(lock,
-                                    [this] { return this->stop || !this->tasks.empty(); });
-                                if (this->stop && this->tasks.empty())
-                                    return;
-                                task = std::move(this->tasks.front());
-                                this->tasks.pop();
-                            }
-
-                            PROFILE_NAME_THREAD(worker);
-                            task();
-                        }
-                    });
+            for (size_t i = 0; i < threads_n; i++)
+                this->workers.emplace_back([this, i] { worker_loop(i); });
         }
     }
     // deleted copy&move ctors&assignments
@@ -95,48 +362,265 @@ public:
     {
         using packaged_task_t = std::packaged_task<typename std::result_of<F(Args...)>::type()>;
 
-        std::shared_ptr<packaged_task_t> task(new packaged_task_t(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...)));
+        // The packaged task is small enough to be stored inline
+        packaged_task_t task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        auto res = task.get_future();
 
         // If there are no works, just run the task in the main thread and return
-        if (workers.empty())
+        if (deques.empty())
         {
-            (*task)();
-            return task->get_future();
+            task();
+            return res;
         }
-        auto res = task->get_future();
+        push(tpool_detail::task(std::move(task)), nullptr);
+        return res;
+    }
+
+    // add a work item without a future, for fine grained jobs; wait() for them to finish
+    template <class F>
+    void run(F&& f)
+    {
+        run(std::forward<F>(f), default_group);
+    }
+
+    template <class F>
+    void run(F&& f, group& g)
+    {
+        if (deques.empty())
         {
-            std::unique_lock<std::mutex> lock(this->queue_mutex);
-            this->tasks.emplace([task]() { (*task)(); });
+            f();
+            return;
+        }
+        push(tpool_detail::task(std::forward<F>(f)), &g.pending);
+    }
+
+    // Runs queued tasks on this thread until the tasks run without a group are done, including any queued meanwhile.
+    // A task which waits shouldn't be in the group it waits on, so it runs its subtasks in a group of its own
+    void wait()
+    {
+        wait(default_group);
+    }
+
+    void wait(group& g)
+    {
+        while (g.pending.load(std::memory_order_acquire) != 0)
+        {
+            auto& self = current();
+            auto node = find_task(self.pool == this ? self.index : deques.size());
+            if (node)
+            {
+                execute(node);
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
         }
-        this->condition.notify_one();
-        return res;
     }
 
     void StopAll()
     {
-        this->stop = true;
+        {
+            std::unique_lock<std::mutex> lock(this->sleep_mutex);
+            this->stop = true;
+        }
         this->condition.notify_all();
         for (std::thread& worker : this->workers)
-            worker.join();
+            if (worker.joinable())
+                worker.join();
     }
 
     // the destructor joins all threads
     virtual ~TPool()
     {
         StopAll();
+
+        tpool_detail::task_node* node;
+        while (free_nodes.try_dequeue(node))
+            delete node;
+    }
+
+private:
+    // Idle workers look this many times before going to sleep
+    static const int SpinRounds = 64;
+
+    struct worker_id
+    {
+        TPool* pool = nullptr;
+        size_t index = 0;
+    };
+
+    static worker_id& current()
+    {
+        static thread_local worker_id id;
+        return id;
+    }
+
+    void push(tpool_detail::task&& fn, std::atomic<size_t>* pending)
+    {
+        tpool_detail::task_node* node;
+        if (!free_nodes.try_dequeue(node))
+            node = new tpool_detail::task_node();
+        node->fn = std::move(fn);
+        node->pending = pending;
+        if (pending)
+            pending->fetch_add(1, std::memory_order_relaxed);
+
+        auto& self = current();
+        if (self.pool == this)
+            deques[self.index]->push(node);
+        else
+            injected.enqueue(node);
+
+        // Only wake a sleeper if nobody is already looking; whoever finds the task wakes the next one
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (searching.load(std::memory_order_seq_cst) == 0 && sleepers.load(std::memory_order_seq_cst) != 0)
+            wake_one();
+    }
+
+    void execute(tpool_detail::task_node* node)
+    {
+        auto pending = node->pending;
+        node->fn();
+        node->fn.reset();
+        free_nodes.enqueue(node);
+        if (pending)
+            pending->fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    // Own deque, then the shared queue, then the other workers' deques
+    tpool_detail::task_node* find_task(size_t index)
+    {
+        tpool_detail::task_node* node = nullptr;
+        if (index < deques.size())
+        {
+            node = deques[index]->pop();
+            if (node)
+                return node;
+        }
+
+        if (injected.try_dequeue(node))
+            return node;
+
+        const auto count = deques.size();
+        const auto start = steal_start.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < count; i++)
+        {
+            const auto victim = (start + i) % count;
+            if (victim == index)
+                continue;
+            node = deques[victim]->steal();
+            if (node)
+                return node;
+        }
+        return nullptr;
+    }
+
+    bool has_work() const
+    {
+        if (injected.size_approx() != 0)
+            return true;
+        for (auto& deque : deques)
+            if (!deque->empty())
+                return true;
+        return false;
+    }
+
+    void wake_one()
+    {
+        {
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake_epoch++;
+        }
+        condition.notify_one();
+    }
+
+    // Looks for work for a while without sleeping; at most half of the workers do this at once
+    tpool_detail::task_node* search(size_t index)
+    {
+        if (searching.load(std::memory_order_relaxed) * 2 >= deques.size())
+            return nullptr;
+
+        searching.fetch_add(1, std::memory_order_seq_cst);
+        for (int round = 0; round < SpinRounds; round++)
+        {
+            auto node = find_task(index);
+            if (node)
+            {
+                // The last searcher to find work hands the search on, in case there is more
+                if (searching.fetch_sub(1, std::memory_order_seq_cst) == 1 && sleepers.load(std::memory_order_seq_cst) != 0)
+                    wake_one();
+                return node;
+            }
+            _mm_pause();
+        }
+        searching.fetch_sub(1, std::memory_order_seq_cst);
+        return nullptr;
+    }
+
+    // Returns false when the pool is stopping and there is nothing left to do
+    bool sleep()
+    {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        // Anything queued before we counted ourselves as asleep is seen here; anything after wakes us
+        bool keep_going = true;
+        if (!has_work())
+        {
+            if (stop)
+            {
+                keep_going = false;
+            }
+            else
+            {
+                const auto epoch = wake_epoch;
+                condition.wait(lock, [this, epoch] { return this->stop || this->wake_epoch != epoch; });
+            }
+        }
+        sleepers.fetch_sub(1, std::memory_order_seq_cst);
+        return keep_going;
+    }
+
+    void worker_loop(size_t index)
+    {
+        PROFILE_NAME_THREAD(worker);
+        current().pool = this;
+        current().index = index;
+
+        while (true)
+        {
+            auto node = find_task(index);
+            if (!node)
+                node = search(index);
+            if (node)
+            {
+                execute(node);
+                continue;
+            }
+            if (!sleep())
+                return;
+        }
     }
 
 private:
     // need to keep track of threads so we can join them
     std::vector<std::thread> workers;
-    // the task queue
-    std::queue<std::function<void()>> tasks;
+    // a deque per worker, and the queue for tasks from other threads
+    std::vector<std::unique_ptr<tpool_detail::work_deque>> deques;
+    moodycamel::ConcurrentQueue<tpool_detail::task_node*> injected;
+    moodycamel::ConcurrentQueue<tpool_detail::task_node*> free_nodes;
+    std::atomic<size_t> steal_start = { 0 };
+    // tasks run without a group, queued and not finished
+    group default_group;
 
     // synchronization
-    std::mutex queue_mutex;
+    std::mutex sleep_mutex;
     std::condition_variable condition;
+    uint64_t wake_epoch = 0;
+    std::atomic<size_t> searching = { 0 };
+    std::atomic<size_t> sleepers = { 0 };
     // workers finalization flag
     std::atomic_bool stop;
 };
-
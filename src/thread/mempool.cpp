@@ -1,8 +1,270 @@
+#include <algorithm>
+
 #include <mutils/thread/mempool.h>
 
 namespace MUtils
 {
 
+namespace
+{
+
+struct PoolEntry
+{
+    IMemoryPool* pPool;
+    const char* pszName;
+};
+
+std::mutex gRegistryMutex;
+std::vector<PoolEntry> gPools;
+
+std::mutex gSlotMutex;
+std::vector<uint32_t> gFreeSlots;
+uint32_t gNextSlot = 0;
+
+struct PoolThreadSlot
+{
+    PoolThreadSlot()
+    {
+        std::lock_guard<std::mutex> lock(gSlotMutex);
+        if (!gFreeSlots.empty())
+        {
+            slot = gFreeSlots.back();
+            gFreeSlots.pop_back();
+        }
+        else if (gNextSlot < PoolMaxThreadSlots)
+        {
+            slot = gNextSlot++;
+        }
+    }
+
+    ~PoolThreadSlot()
+    {
+        // Items left in the magazines belong to the pools, so the next thread in this slot inherits them
+        if (slot != PoolInvalidSlot)
+        {
+            std::lock_guard<std::mutex> lock(gSlotMutex);
+            gFreeSlots.push_back(slot);
+        }
+    }
+
+    uint32_t slot = PoolInvalidSlot;
+};
+
+} // namespace
+
+uint32_t pool_thread_slot()
+{
+    thread_local PoolThreadSlot threadSlot;
+    return threadSlot.slot;
+}
+
+void pool_register(IMemoryPool* pPool, const char* pszName)
+{
+    std::lock_guard<std::mutex> lock(gRegistryMutex);
+    for (auto& entry : gPools)
+    {
+        if (entry.pPool == pPool)
+        {
+            entry.pszName = pszName;
+            return;
+        }
+    }
+    gPools.push_back(PoolEntry{ pPool, pszName });
+}
+
+void pool_unregister(IMemoryPool* pPool)
+{
+    std::lock_guard<std::mutex> lock(gRegistryMutex);
+    gPools.erase(std::remove_if(gPools.begin(), gPools.end(), [pPool](auto& entry) { return entry.pPool == pPool; }), gPools.end());
+}
+
+void pool_visit_stats(const std::function<void(const char*, const PoolStats&)>& fnVisit)
+{
+    std::lock_guard<std::mutex> lock(gRegistryMutex);
+    for (auto& entry : gPools)
+    {
+        fnVisit(entry.pszName, entry.pPool->GetStats());
+    }
+}
+
+size_t IntrusiveList::Size() const
+{
+    if (m_size == UnknownSize)
+    {
+        m_size = 0;
+        for (auto pItem = m_pFront; pItem; pItem = pItem->m_pNext)
+        {
+            m_size++;
+        }
+    }
+    return m_size;
+}
+
+void IntrusiveList::PushFront(gsl::not_null<IListItem*> pItem)
+{
+    LinkChain(nullptr, pItem, pItem, 1);
+}
+
+void IntrusiveList::PushBack(gsl::not_null<IListItem*> pItem)
+{
+    LinkChain(m_pBack, pItem, pItem, 1);
+}
+
+void IntrusiveList::InsertAfter(IListItem* pPos, gsl::not_null<IListItem*> pItem)
+{
+    LinkChain(pPos, pItem, pItem, 1);
+}
+
+void IntrusiveList::InsertBefore(IListItem* pPos, gsl::not_null<IListItem*> pItem)
+{
+    LinkChain(pPos ? pPos->m_pPrevious : m_pBack, pItem, pItem, 1);
+}
+
+IListItem* IntrusiveList::Erase(gsl::not_null<IListItem*> pItem)
+{
+    auto pNext = EraseRange(pItem, pItem, 1);
+    pItem->m_pNext = nullptr;
+    pItem->m_pPrevious = nullptr;
+    return pNext;
+}
+
+IListItem* IntrusiveList::EraseRange(gsl::not_null<IListItem*> pFirst, gsl::not_null<IListItem*> pLast, size_t count)
+{
+    assert(m_pFront != nullptr);
+
+    auto pBefore = pFirst->m_pPrevious;
+    auto pAfter = pLast->m_pNext;
+
+    if (pBefore)
+    {
+        pBefore->m_pNext = pAfter;
+    }
+    else
+    {
+        assert(m_pFront == pFirst);
+        m_pFront = pAfter;
+    }
+
+    if (pAfter)
+    {
+        pAfter->m_pPrevious = pBefore;
+    }
+    else
+    {
+        assert(m_pBack == pLast);
+        m_pBack = pBefore;
+    }
+
+    pFirst->m_pPrevious = nullptr;
+    pLast->m_pNext = nullptr;
+
+    if (m_pFront == nullptr)
+    {
+        m_size = 0;
+    }
+    else if (count == UnknownSize || m_size == UnknownSize)
+    {
+        m_size = UnknownSize;
+    }
+    else
+    {
+        assert(m_size > count);
+        m_size -= count;
+    }
+    return pAfter;
+}
+
+void IntrusiveList::Splice(IListItem* pPos, IntrusiveList& other, gsl::not_null<IListItem*> pFirst, gsl::not_null<IListItem*> pLast, size_t count)
+{
+    other.EraseRange(pFirst, pLast, count);
+    LinkChain(pPos, pFirst, pLast, count);
+}
+
+void IntrusiveList::SpliceBack(IntrusiveList& other)
+{
+    if (other.Empty() || &other == this)
+    {
+        return;
+    }
+
+    auto pFirst = other.m_pFront;
+    auto pLast = other.m_pBack;
+    auto count = other.m_size;
+    other.Reset();
+    LinkChain(m_pBack, pFirst, pLast, count);
+}
+
+void IntrusiveList::FreeRange(gsl::not_null<IListItem*> pFirst, gsl::not_null<IListItem*> pLast, size_t count)
+{
+    EraseRange(pFirst, pLast, count);
+
+    IListItem* pItem = pFirst;
+    while (pItem)
+    {
+        auto pNext = pItem->m_pNext;
+        pItem->m_pNext = nullptr;
+        pItem->m_pPrevious = nullptr;
+
+        // Already unlinked, so go straight to the pool instead of PoolItem::Free
+        auto pPoolItem = static_cast<PoolItem*>(pItem);
+        pPoolItem->m_pPool->Free(pPoolItem);
+        pItem = pNext;
+    }
+}
+
+void IntrusiveList::FreeAll()
+{
+    if (m_pFront)
+    {
+        FreeRange(m_pFront, m_pBack, Size());
+    }
+}
+
+void IntrusiveList::Reset()
+{
+    m_pFront = nullptr;
+    m_pBack = nullptr;
+    m_size = 0;
+}
+
+// Link an unattached chain after pPos; or at the front if pPos is null
+void IntrusiveList::LinkChain(IListItem* pPos, IListItem* pFirst, IListItem* pLast, size_t count)
+{
+    assert(pFirst->m_pPrevious == nullptr);
+    assert(pLast->m_pNext == nullptr);
+
+    auto pAfter = pPos ? pPos->m_pNext : m_pFront;
+    pFirst->m_pPrevious = pPos;
+    pLast->m_pNext = pAfter;
+
+    if (pPos)
+    {
+        pPos->m_pNext = pFirst;
+    }
+    else
+    {
+        m_pFront = pFirst;
+    }
+
+    if (pAfter)
+    {
+        pAfter->m_pPrevious = pLast;
+    }
+    else
+    {
+        m_pBack = pLast;
+    }
+
+    if (count == UnknownSize || m_size == UnknownSize)
+    {
+        m_size = UnknownSize;
+    }
+    else
+    {
+        m_size += count;
+    }
+}
+
 IListItem* list_root(gsl::not_null<IListItem*> pEvent)
 {
     auto pCheck = pEvent;
@@ -16,35 +278,18 @@ IListItem* list_root(gsl::not_null<IListItem*> pEvent)
 
 void list_insert_after(IListItem* pPos, gsl::not_null<IListItem*> pInsert)
 {
-    // If new, make it the begin/end of the pool
     auto pPool = pInsert->m_pPool;
-    if (pPos == nullptr)
+    if (pPool)
     {
-        if (pPool)
-        {
-            // Insert after NULL means insert before first
-            if (pPool->m_pRoot)
-            {
-                list_insert_before(pPool->m_pRoot, pInsert);
-                return;
-            }
-
-            // Or start again
-            assert(pPool->m_pLast == nullptr);
-            pPool->m_pRoot = pInsert;
-            pPool->m_pLast = pInsert;
-            return;
-        }
-        else
-        {
-            assert(!"No pool?");
-        }
+        // Insert after NULL means insert before first
+        pPool->m_list.InsertAfter(pPos, pInsert);
+        return;
     }
 
-    // Making a new end
-    if (pPool && pPool->m_pLast == pPos)
+    assert(pPos && "No pool?");
+    if (pPos == nullptr)
     {
-        pPool->m_pLast = pInsert;
+        return;
     }
 
     auto pAfter = pPos->m_pNext; // After insertion point
@@ -55,40 +300,23 @@ void list_insert_after(IListItem* pPos, gsl::not_null<IListItem*> pInsert)
         pAfter->m_pPrevious = pInsert;
     }
     pInsert->m_pNext = pAfter; // Point us at the thing after
-
-    if (pPool)
-    {
-        assert(pPool->m_pRoot->m_pPrevious == nullptr);
-        assert(pPool->m_pLast->m_pNext == nullptr);
-    }
-
-#ifdef _DEBUG
-    //timeline_validate(pInsert);
-#endif
 }
 
 void list_insert_before(IListItem* pPos, gsl::not_null<IListItem*> pInsert)
 {
     auto pPool = pInsert->m_pPool;
-    if (pPos == nullptr)
+    if (pPool)
     {
-        if (pPool)
-        {
-            assert(pPool->m_pRoot == nullptr);
-            assert(pPool->m_pLast == nullptr);
-            pPool->m_pRoot = pInsert;
-            pPool->m_pLast = pInsert;
-            return;
-        }
-        else
-        {
-            assert(!"No pool?");
-            return;
-        }
+        // Insert before NULL means insert after last
+        pPool->m_list.InsertBefore(pPos, pInsert);
+        return;
     }
 
-    assert(pPos);
-    assert(pInsert);
+    assert(pPos && "No pool?");
+    if (pPos == nullptr)
+    {
+        return;
+    }
 
     auto pBefore = pPos->m_pPrevious;
     pPos->m_pPrevious = pInsert;
@@ -98,49 +326,20 @@ void list_insert_before(IListItem* pPos, gsl::not_null<IListItem*> pInsert)
         pBefore->m_pNext = pInsert;
     }
     pInsert->m_pNext = pPos;
-
-#ifdef _DEBUG
-    //timeline_validate(pInsert);
-#endif
-    if (pPool && pPool->m_pRoot == pPos)
-    {
-        pPool->m_pRoot = pInsert;
-        assert(pPool->m_pRoot->m_pPrevious == nullptr);
-        assert(pPool->m_pLast->m_pNext == nullptr);
-    }
 }
 
 IListItem* list_disconnect(gsl::not_null<IListItem*> pEvent)
 {
-    // TODO: This is wrong, pool items if orphaned couldn't be freed.
-    // So how to deal with disconnected chains that are later modified?
-    // Perhaps that is not allowed?  But the chain must be freeable.
+    // Items which are not in their pool's list are just unlinked from their neighbours
     auto pPool = pEvent->m_pPool;
-    if (pPool)
+    if (pPool && pPool->m_pOwner)
     {
-        if (pEvent == pPool->m_pRoot)
-        {
-            if (pEvent->m_pNext)
-            {
-                pPool->m_pRoot = pEvent->m_pNext;
-            }
-            else
-            {
-                pPool->m_pRoot = nullptr;
-            }
-        }
+        return pPool->m_pOwner->Unlink(pEvent);
+    }
 
-        if (pEvent == pPool->m_pLast)
-        {
-            if (pEvent->m_pPrevious)
-            {
-                pPool->m_pLast = pEvent->m_pPrevious;
-            }
-            else
-            {
-                pPool->m_pLast = nullptr;
-            }
-        }
+    if (pPool && (pEvent->m_pPrevious || pEvent->m_pNext || pPool->m_list.Front() == pEvent))
+    {
+        return pPool->m_list.Erase(pEvent);
     }
 
     auto pNext = pEvent->m_pNext;
@@ -156,30 +355,12 @@ IListItem* list_disconnect(gsl::not_null<IListItem*> pEvent)
 
     pEvent->m_pPrevious = nullptr;
     pEvent->m_pNext = nullptr;
-
-#ifdef _DEBUG
-    //timeline_validate(pEvent);
-#endif
-
-    if (pPool)
-    {
-        if (pPool->m_pRoot)
-        {
-            pPool->m_pRoot->m_pPrevious = nullptr;
-        }
-
-        if (pPool->m_pLast)
-        {
-            pPool->m_pLast->m_pNext = nullptr;
-        }
-    }
-
     return pNext;
 }
 
 IListItem* list_disconnect_range(IListItem* pBegin, IListItem* pEnd)
 {
-    // Find the end if null
+    // Find the end if null; the end of pBegin's chain
     if (pEnd == nullptr)
     {
         assert(pBegin != nullptr);
@@ -187,91 +368,25 @@ IListItem* list_disconnect_range(IListItem* pBegin, IListItem* pEnd)
         {
             return nullptr;
         }
-        pEnd = pBegin;
-        while (pEnd && pEnd->m_pNext)
-        {
-            pEnd = pEnd->m_pNext;
-        }
+        pEnd = list_end(gsl::not_null<IListItem*>(pBegin));
     }
 
     // find the beginning if null
     if (pBegin == nullptr)
     {
-        assert(pEnd != nullptr);
-        if (pEnd == nullptr)
-        {
-            return nullptr;
-        }
-        pBegin = pEnd;
-        while (pBegin && pBegin->m_pPrevious)
-        {
-            pBegin = pBegin->m_pPrevious;
-        }
-    }
-
-    // Must have a valid chain
-    if (pBegin == nullptr || pEnd == nullptr)
-    {
-        return nullptr;
+        pBegin = list_root(gsl::not_null<IListItem*>(pEnd));
     }
 
     auto pPool = pBegin->m_pPool;
-    assert(pPool = pEnd->m_pPool);
-
-    // Fix up root
-    if (pBegin == pPool->m_pRoot)
+    assert(pPool != nullptr && pPool == pEnd->m_pPool);
+    if (pPool == nullptr)
     {
-        if (pBegin->m_pNext)
-        {
-            pPool->m_pRoot = pBegin->m_pNext;
-        }
-        else
-        {
-            pPool->m_pRoot = nullptr;
-        }
-        assert(pPool->m_pRoot == nullptr || pPool->m_pRoot->m_pPrevious == nullptr);
-    }
-
-    if (pEnd == pPool->m_pLast)
-    {
-        if (pEnd->m_pPrevious)
-        {
-            pPool->m_pLast = pEnd->m_pPrevious;
-        }
-        else
-        {
-            pPool->m_pLast = nullptr;
-        }
-        assert(pPool->m_pLast == nullptr || pPool->m_pLast->m_pNext == nullptr);
-    }
-
-    if (pBegin == nullptr || pEnd == nullptr)
         return nullptr;
-
-    // Disconnect from the chain
-    auto pNext = pEnd->m_pNext;
-    assert(pBegin != pEnd);
-
-    if (pBegin->m_pPrevious)
-    {
-        pBegin->m_pPrevious->m_pNext = pEnd->m_pNext;
     }
 
-    if (pEnd->m_pNext)
-    {
-        pEnd->m_pNext->m_pPrevious = pBegin->m_pPrevious;
-    }
-
-    pBegin->m_pPrevious = nullptr;
-    pEnd->m_pNext = nullptr;
-
-    // Validate the new chain; it has been sliced out
-#ifdef _DEBUG
-    //timeline_validate(pBegin);
-#endif
-
-    // Return the new strand
-    return pNext;
+    // Uncounted; the list recounts lazily if its size is asked for.
+    // Return the item after the range, which has been sliced out
+    return pPool->m_list.EraseRange(pBegin, pEnd);
 }
 
 IListItem* list_end(gsl::not_null<IListItem*> pEvent)
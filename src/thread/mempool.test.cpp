@@ -0,0 +1,277 @@
+#include <catch2/catch.hpp>
+#include <set>
+#include <thread>
+
+#include "mutils/thread/mempool.h"
+
+using namespace MUtils;
+
+namespace
+{
+struct TestItem : public PoolItem
+{
+    DECLARE_POOL_ITEM(TestItem);
+
+    TestItem(IMemoryPool* pPool, uint64_t id)
+        : PoolItem(pPool, id)
+    {
+    }
+
+    virtual void Init() override
+    {
+        value = 0;
+    }
+
+    int value = 0;
+};
+} // namespace
+
+TEST_CASE("MemoryPool.Slabs", "[MemPool]")
+{
+    MemoryPool<TestItem> pool(4, 8);
+
+    SECTION("Initial slab is contiguous")
+    {
+        auto p1 = pool.Alloc();
+        auto p2 = pool.Alloc();
+        REQUIRE(p2 == p1 + 1);
+        REQUIRE((uintptr_t(p1) % PoolCacheLineSize) == 0);
+    }
+
+    SECTION("Grows past the initial size")
+    {
+        std::vector<TestItem*> items;
+        for (int i = 0; i < 20; i++)
+        {
+            items.push_back(pool.Alloc());
+        }
+        REQUIRE(items[19]->m_id == 19);
+        for (auto& pItem : items)
+        {
+            pItem->Free();
+        }
+        REQUIRE(pool.Alloc() == items[19]);
+    }
+}
+
+TEST_CASE("TSMemoryPool.Slabs", "[MemPool]")
+{
+    TSMemoryPool<TestItem> pool(0, 16);
+
+    auto p1 = pool.Alloc();
+    REQUIRE(p1->m_pPool == &pool);
+    p1->value = 5;
+    p1->Free();
+
+    auto p2 = pool.Alloc();
+    REQUIRE(p2->value == 0);
+
+    // Clear releases items that are still in use, too
+    pool.Clear();
+    REQUIRE(pool.m_list.Empty());
+}
+
+TEST_CASE("TSMemoryPool.InitialSize", "[MemPool]")
+{
+    TSMemoryPool<TestItem> pool(8, 8);
+
+    // Every item of the initial slab is handed out before the pool grows
+    std::vector<TestItem*> items;
+    for (int i = 0; i < 8; i++)
+    {
+        items.push_back(pool.Alloc());
+    }
+    REQUIRE(pool.GetStats().misses == 0);
+    REQUIRE(pool.GetStats().freeItems == 0);
+
+    items.push_back(pool.Alloc());
+    REQUIRE(pool.GetStats().misses == 1);
+}
+
+TEST_CASE("TSMemoryPool.Threads", "[MemPool]")
+{
+    TSMemoryPool<TestItem> pool(64);
+
+    const int ThreadCount = 8;
+    const int ItemCount = 1000;
+    std::vector<std::vector<uint64_t>> ids(ThreadCount);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < ThreadCount; t++)
+    {
+        threads.emplace_back([&, t]() {
+            std::vector<TestItem*> items;
+            for (int i = 0; i < ItemCount; i++)
+            {
+                items.push_back(pool.Alloc());
+                ids[t].push_back(items.back()->m_id);
+
+                // Free some as we go, so magazines swap with the depot
+                if ((i % 3) == 0)
+                {
+                    items.back()->Free();
+                    items.pop_back();
+                }
+            }
+            for (auto& pItem : items)
+            {
+                pItem->Free();
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    std::set<uint64_t> unique;
+    for (auto& threadIds : ids)
+    {
+        unique.insert(threadIds.begin(), threadIds.end());
+    }
+    REQUIRE(unique.size() == ThreadCount * ItemCount);
+}
+
+TEST_CASE("MemoryPool.Stats", "[MemPool]")
+{
+    MemoryPool<TestItem> pool(2, 4);
+    pool_register(&pool, "Test");
+
+    auto p1 = pool.Alloc();
+    auto p2 = pool.Alloc();
+    auto p3 = pool.Alloc();
+    p3->Free();
+
+    auto stats = pool.GetStats();
+    REQUIRE(stats.liveItems == 2);
+    REQUIRE(stats.freeItems == 4);
+    REQUIRE(stats.peakLiveItems == 3);
+    REQUIRE(stats.misses == 1);
+    REQUIRE(stats.bytesReserved == sizeof(TestItem) * 6);
+
+    int visited = 0;
+    pool_visit_stats([&](const char* pszName, const PoolStats& poolStats) {
+        if (std::string(pszName) == "Test")
+        {
+            REQUIRE(poolStats.liveItems == 2);
+            visited++;
+        }
+    });
+    REQUIRE(visited == 1);
+
+    p1->Free();
+    p2->Free();
+}
+
+TEST_CASE("TSMemoryPool.Stats", "[MemPool]")
+{
+    TSMemoryPool<TestItem> pool(4, 4);
+
+    std::vector<TestItem*> items;
+    for (int i = 0; i < 6; i++)
+    {
+        items.push_back(pool.Alloc());
+    }
+
+    auto stats = pool.GetStats();
+    REQUIRE(stats.liveItems == 6);
+    REQUIRE(stats.freeItems == 2);
+    REQUIRE(stats.misses == 1);
+
+    std::thread([&]() {
+        // Freed on another thread
+        items[0]->Free();
+    }).join();
+
+    stats = pool.GetStats();
+    REQUIRE(stats.liveItems == 5);
+    REQUIRE(stats.peakLiveItems == 6);
+}
+
+TEST_CASE("IntrusiveList", "[MemPool]")
+{
+    MemoryPool<TestItem> pool(8);
+
+    IntrusiveList list;
+    std::vector<TestItem*> items;
+    for (int i = 0; i < 6; i++)
+    {
+        items.push_back(pool.Alloc());
+        items.back()->value = i;
+        list.PushBack(items.back());
+    }
+    REQUIRE(list.Size() == 6);
+    REQUIRE(list.Front() == items[0]);
+    REQUIRE(list.Back() == items[5]);
+
+    SECTION("Splice a range between lists")
+    {
+        IntrusiveList other;
+        other.Splice(nullptr, list, items[1], items[3], 3);
+        REQUIRE(list.Size() == 3);
+        REQUIRE(other.Size() == 3);
+        REQUIRE(items[0]->m_pNext == items[4]);
+
+        int expected = 1;
+        for (auto pItem : other.Items<TestItem>())
+        {
+            REQUIRE(pItem->value == expected++);
+        }
+        REQUIRE(expected == 4);
+
+        // Range back onto the end
+        list.SpliceBack(other);
+        REQUIRE(other.Empty());
+        REQUIRE(list.Back() == items[3]);
+        REQUIRE(list.Size() == 6);
+    }
+
+    SECTION("Unknown range length is counted on demand")
+    {
+        list.EraseRange(items[0], items[1]);
+        REQUIRE(list.Front() == items[2]);
+        REQUIRE(list.Size() == 4);
+    }
+
+    SECTION("Free a range back to the pool")
+    {
+        list.FreeRange(items[2], items[5], 4);
+        REQUIRE(list.Size() == 2);
+        REQUIRE(list.Back() == items[1]);
+        REQUIRE(pool.GetStats().liveItems == 2);
+
+        list.FreeAll();
+        REQUIRE(list.Empty());
+        REQUIRE(pool.GetStats().liveItems == 0);
+    }
+}
+
+TEST_CASE("IntrusiveList.DisconnectRange", "[MemPool]")
+{
+    MemoryPool<TestItem> pool(8);
+
+    std::vector<TestItem*> items;
+    for (int i = 0; i < 6; i++)
+    {
+        items.push_back(pool.Alloc());
+        list_insert_after(i ? items[i - 1] : nullptr, items.back());
+    }
+    REQUIRE(pool.m_list.Size() == 6);
+
+    // A null end is the end of the chain, and a null begin its start
+    REQUIRE(list_disconnect_range(items[4], nullptr) == nullptr);
+    REQUIRE(items[4]->m_pNext == items[5]);
+    REQUIRE(pool.m_list.Size() == 4);
+
+    REQUIRE(list_disconnect_range(nullptr, items[1]) == items[2]);
+    REQUIRE(items[0]->m_pNext == items[1]);
+    REQUIRE(pool.m_list.Front() == items[2]);
+    REQUIRE(pool.m_list.Size() == 2);
+
+    for (auto pItem : items)
+    {
+        pItem->m_pNext = nullptr;
+        pItem->m_pPrevious = nullptr;
+        pool.Free(pItem);
+    }
+}
@@ -0,0 +1,106 @@
+#include <catch2/catch.hpp>
+#include <atomic>
+#include <functional>
+#include <numeric>
+
+#include <threadpool/threadpool.h>
+
+TEST_CASE("TPool.Enqueue", "[TPool]")
+{
+    TPool pool(4);
+
+    std::vector<std::future<int>> results;
+    for (int i = 0; i < 1000; i++)
+    {
+        results.push_back(pool.enqueue([](int a, int b) { return a * b; }, i, 2));
+    }
+
+    for (int i = 0; i < 1000; i++)
+    {
+        REQUIRE(results[i].get() == i * 2);
+    }
+
+    // A single thread runs them straight away
+    TPool inlinePool(1);
+    REQUIRE(inlinePool.enqueue([]() { return 7; }).get() == 7);
+}
+
+TEST_CASE("TPool.Steal", "[TPool]")
+{
+    TPool pool(4);
+
+    // Tasks queued from a task go on that worker's deque; the others steal them
+    std::atomic<int> count = 0;
+    std::atomic<uint64_t> sum = 0;
+    for (int outer = 0; outer < 100; outer++)
+    {
+        pool.run([&pool, &count, &sum, outer]() {
+            for (int inner = 0; inner < 100; inner++)
+            {
+                pool.run([&count, &sum, outer, inner]() {
+                    count++;
+                    sum += outer * 100 + inner;
+                });
+            }
+        });
+    }
+    pool.wait();
+
+    REQUIRE(count == 10000);
+    REQUIRE(sum == 10000ull * 9999 / 2);
+
+    // Large captures go on the heap
+    std::array<uint64_t, 32> values;
+    std::iota(values.begin(), values.end(), 1);
+    pool.run([values, &sum]() { sum += std::accumulate(values.begin(), values.end(), uint64_t(0)); });
+    pool.wait();
+    REQUIRE(sum == 10000ull * 9999 / 2 + 32 * 33 / 2);
+
+    // Queued work is done before the workers stop
+    for (int i = 0; i < 1000; i++)
+    {
+        pool.run([&count]() { count++; });
+    }
+    pool.StopAll();
+    REQUIRE(count == 11000);
+}
+
+TEST_CASE("TPool.NestedWait", "[TPool]")
+{
+    TPool pool(4);
+
+    // A task may wait for the tasks it runs; it isn't counted by the wait itself
+    std::atomic<int> count = 0;
+    auto result = pool.enqueue([&pool, &count]() {
+        for (int i = 0; i < 10; i++)
+        {
+            pool.run([&count]() { count++; });
+        }
+        pool.wait();
+        return count.load();
+    });
+    REQUIRE(result.get() == 10);
+
+    // Fork/join from inside run tasks, with a group per level
+    std::function<uint64_t(uint64_t, uint64_t)> sum = [&](uint64_t begin, uint64_t end) -> uint64_t {
+        if (end - begin <= 16)
+        {
+            uint64_t total = 0;
+            for (auto i = begin; i < end; i++)
+                total += i;
+            return total;
+        }
+        auto mid = begin + (end - begin) / 2;
+        uint64_t left = 0;
+        TPool::group g;
+        pool.run([&]() { left = sum(begin, mid); }, g);
+        auto right = sum(mid, end);
+        pool.wait(g);
+        return left + right;
+    };
+
+    uint64_t total = 0;
+    pool.run([&]() { total = sum(0, 10000); });
+    pool.wait();
+    REQUIRE(total == 10000ull * 9999 / 2);
+}
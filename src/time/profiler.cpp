@@ -1,8 +1,32 @@
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <tuple>
+
+#ifdef MUTILS_PROFILER_ALLOCATIONS
+#if defined(_WIN32)
+#include <malloc.h>
+#define MUTILS_BLOCK_SIZE(p) _msize(p)
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#define MUTILS_BLOCK_SIZE(p) malloc_size(p)
+#else
+#include <malloc.h>
+#define MUTILS_BLOCK_SIZE(p) malloc_usable_size(p)
+#endif
+#endif
 
 #include <mutils/time/profiler.h>
+#include <mutils/thread/mempool.h>
 #include <mutils/math/imgui_glm.h>
 #include <mutils/math/math_utils.h>
 #include <mutils/ui/dpi.h>
@@ -23,7 +47,7 @@ using namespace std::chrono;
 // Has a summary view and support for zoom/pan, CTRL+select range or click in the summary
 // There is an optional single 'Region' which I use for audio frame profiling
 // The profile macros can pick a unique/nice color for a given name
-// There is a LOCK_GUARD wrapper around a mutex, for tracking lock times
+// There is a LOCK_GUARD wrapper around a mutex, for tracking lock times and contention per site
 namespace MUtils
 {
 
@@ -36,38 +60,66 @@ namespace
 {
 
 const unsigned int frameMarkerColor = 0x22FFFFFF;
+const unsigned int AllocColor = 0xFF3080FF;
+const unsigned int AllocFreeColor = 0xFF808080;
 const uint32_t MaxThreads = 50;
 const uint32_t MaxCallStack = 20;
-const uint32_t MaxEntriesPerThread = 100000;
+const uint32_t DefaultEntriesPerThread = 100000;
 const uint32_t MaxFrames = 10000;
 const uint32_t MaxRegions = 10000;
 const uint32_t MinLeadInFrames = 3;
 const uint32_t MinFrame = MinLeadInFrames - 2;
 const uint32_t MinSizeForTextDisplay = 5;
-
-MUtils::timer gTimer;
-bool gPaused = true;
-bool gRestarting = true;
-
+const uint32_t InvalidEntry = 0xFFFFFFFF;
+const uint32_t MaxLocations = 1 << 16;
+const uint32_t InitialEntriesPerThread = 4096;
+const uint32_t MaxAllocationsPerThread = 100000;
+
+// Per thread ring sizes; the collector drains them every CollectorInterval
+const uint32_t RingSize = 1 << 14;
+const uint32_t RingHeadroom = MaxCallStack + 4;
+const auto CollectorInterval = milliseconds(1);
+
+// Raw timer ticks at the start of the capture; records are ticks since then, converted by the collector
+uint64_t gStartTicks = 0;
+std::atomic<bool> gPaused = true;
+std::atomic<bool> gContinuous = false;
+std::atomic<bool> gTrackAllocations = true;
+
+// Entries kept per thread before the capture is full (or rolls, in continuous mode); set by Init
+uint32_t gMaxEntriesPerThread = DefaultEntriesPerThread;
+
+// Guards the display data below, and the thread rings list
 std::mutex gMutex;
 
-std::atomic<uint64_t> gProfilerGeneration = 0;
-thread_local int gThreadIndexTLS = -1;
-thread_local uint64_t gGenerationTLS = -1;
 float gMaxThreadNameSize = 0;
 
 std::vector<ThreadData> gThreadData;
 std::vector<Frame> gFrameData;
-std::vector<Region> gRegionData;
+
+// A named periodic region, such as an audio callback; times are nanoseconds
+struct RegionTrack
+{
+    std::string name;
+    int64_t budget = 0;
+    uint64_t count = 0;
+    uint64_t overruns = 0;
+    int64_t maxTime = 0;
+    bool open = false;
+    std::vector<Region> regions;
+    uint32_t currentRegion = 0;
+    int64_t displayStart = 0;
+};
+
+// Tracks outlive a reset, so their budgets are kept. The lookup is by location id
+std::vector<RegionTrack> gRegionTracks;
+std::unordered_map<uint32_t, uint32_t> gRegionTrackLookup;
+SourceLocation gDefaultRegionLocation{ "Region", "", 0, 0xFF888888 };
 
 int64_t gMaxFrameTime = duration_cast<nanoseconds>(milliseconds(20)).count();
 uint32_t gCurrentFrame = 0;
 int32_t gSelectedThread = -1;
 
-// Region
-uint32_t gCurrentRegion = 0;
-int64_t gRegionTimeLimit = 0;
-int64_t gRegionDisplayStart = 0;
 int64_t gFrameDisplayStart = 0;
 NRectf gCandleDragRect;
 
@@ -80,32 +132,210 @@ NVec2ll gTimeRange = NVec2ll(0, 0);
 // Frames visible inside the current time range
 NVec2i gVisibleFrames = NVec2i(0, 0);
 
-} // namespace
+enum class RecordType : uint32_t
+{
+    Begin,
+    End,
+    Frame,
+    RegionBegin,
+    RegionEnd,
+    Alloc,
+    Free
+};
+
+// What a thread writes for the collector; allocations put their size in the location
+struct ProfilerRecord
+{
+    RecordType type;
+    uint32_t location;
+    int64_t time;
+};
 
-// Run Init every time a profile is started
-void Init(uint32_t maxEntries)
+// Interned source locations, indexed by id. Written once under the lock, then read freely
+SourceLocation gUnknownLocation{ "Unknown", "", 0, 0xFF888888 };
+SourceLocation* gLocations[MaxLocations] = { &gUnknownLocation };
+std::atomic<uint32_t> gLocationCount = 1;
+std::mutex gLocationMutex;
+
+// LOCK_GUARD sites, pushed on first use and never removed
+std::atomic<LockSite*> gLockSites = nullptr;
+
+struct DynamicKey
 {
-    gThreadData.resize(MaxThreads);
+    const char* szSection;
+    const char* szFile;
+    int line;
+    uint32_t color;
+    uint32_t flags;
+
+    bool operator==(const DynamicKey& rhs) const
+    {
+        return szSection == rhs.szSection && szFile == rhs.szFile && line == rhs.line && color == rhs.color && flags == rhs.flags;
+    }
+};
+
+struct DynamicKeyHash
+{
+    size_t operator()(const DynamicKey& key) const
+    {
+        return std::hash<const void*>()(key.szSection) ^ (std::hash<const void*>()(key.szFile) << 1) ^ (size_t(key.line) << 2) ^ key.color;
+    }
+};
+
+// Locations made for callers which pass strings instead; i.e. PushSectionBase. One per key for the process,
+// guarded by gLocationMutex, with a per thread cache in front so the lock is only taken on a thread's first use
+std::unordered_map<DynamicKey, std::unique_ptr<SourceLocation>, DynamicKeyHash> gDynamicLocations;
+thread_local std::unordered_map<DynamicKey, SourceLocation*, DynamicKeyHash> gDynamicLocationsTLS;
+
+// Single producer (the owning thread), single consumer (the collector).
+// The producer never waits; if the collector falls behind, new records are dropped.
+// Ends always fit, since begins leave room for the call stack to unwind.
+struct ThreadRing
+{
+    uint32_t threadIndex = 0;
+    std::string name;
+    bool hidden = false;
+
+    // Set by the owning thread as it exits; the collector frees the ring once it has drained it
+    std::atomic<bool> exited = false;
+    bool free = false;
+
+    alignas(64) std::atomic<uint64_t> write = 0;
+    uint64_t droppedDepth = 0;
+    alignas(64) std::atomic<uint64_t> read = 0;
+    std::atomic<uint64_t> dropped = 0;
+
+    ProfilerRecord records[RingSize];
+
+    bool Push(const ProfilerRecord& record, uint32_t headroom)
+    {
+        auto w = write.load(std::memory_order_relaxed);
+        if (w - read.load(std::memory_order_acquire) >= RingSize - headroom)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        records[w & (RingSize - 1)] = record;
+        write.store(w + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// Rings of threads which have exited are reused by new ones, so they keep their slot (and display track)
+std::vector<std::unique_ptr<ThreadRing>> gRings;
+std::vector<ThreadRing*> gFreeRings;
+thread_local ThreadRing* gThreadRingTLS = nullptr;
+
+// Set once the thread's ring has been handed back; anything recorded after that (i.e. by other thread_local destructors) is dropped
+thread_local bool gThreadExitedTLS = false;
 
-    gProfilerGeneration++;
+struct ThreadRingOwner
+{
+    ThreadRing* pRing = nullptr;
+
+    ~ThreadRingOwner()
+    {
+        gThreadExitedTLS = true;
+        gThreadRingTLS = nullptr;
+        if (pRing)
+        {
+            pRing->exited.store(true, std::memory_order_release);
+        }
+    }
+};
+thread_local ThreadRingOwner gThreadRingOwner;
+
+// Frame marks are applied once every ring has been drained
+std::vector<int64_t> gPendingFrames;
+
+// Zone durations go in log2 buckets, each split in 4, so percentiles are within 25%
+const uint32_t HistogramSubBuckets = 4;
+const uint32_t HistogramBuckets = 64 * HistogramSubBuckets;
+
+struct ZoneAccumulator
+{
+    uint64_t count = 0;
+    int64_t inclusiveTime = 0;
+    int64_t exclusiveTime = 0;
+    int64_t minTime = std::numeric_limits<int64_t>::max();
+    int64_t maxTime = 0;
+    uint64_t histogram[HistogramBuckets] = {};
+    uint64_t allocations = 0;
+    uint64_t allocatedBytes = 0;
+};
+
+// Indexed by location id
+std::vector<ZoneAccumulator> gZoneStats;
+
+void CollectorMain();
+
+// Drains the rings in the background; stopped by Finish, or on exit
+struct Collector
+{
+    std::thread thread;
+    std::atomic<bool> running = false;
+
+    void Start()
+    {
+        if (!thread.joinable())
+        {
+            running = true;
+            thread = std::thread(CollectorMain);
+        }
+    }
+
+    void Stop()
+    {
+        running = false;
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+
+    ~Collector()
+    {
+        // The rings are about to go, and the allocation hooks may still be called
+        gTrackAllocations = false;
+        Stop();
+    }
+};
+
+// Declared after the data it uses, so it is destroyed first
+Collector gCollector;
+
+// Clear the display data; called with the lock held
+void InitData()
+{
+    gThreadData.resize(MaxThreads);
 
     for (uint32_t iZero = 0; iZero < MaxThreads; iZero++)
     {
         ThreadData* threadData = &gThreadData[iZero];
-        threadData->initialized = iZero == 0;
+        threadData->initialized = iZero < gRings.size();
         threadData->maxLevel = 0;
         threadData->minTime = std::numeric_limits<int64_t>::max();
         threadData->maxTime = 0;
         threadData->currentEntry = 0;
-        threadData->name = std::string("Thread ") + std::to_string(iZero);
-        threadData->entries.resize(MaxEntriesPerThread);
-        memset(threadData->entries.data(), 0, sizeof(ProfilerEntry) * threadData->entries.size());
+        threadData->name = threadData->initialized ? gRings[iZero]->name : std::string("Thread ") + std::to_string(iZero);
+        threadData->hidden = threadData->initialized ? gRings[iZero]->hidden : false;
+        threadData->longEnds.clear();
+        threadData->allocations.clear();
         threadData->entryStack.resize(50);
+        threadData->childTimeStack.resize(50);
         threadData->callStackDepth = 0;
     }
 
     gFrameData.resize(MaxFrames);
-    gRegionData.resize(MaxRegions);
+    for (auto& track : gRegionTracks)
+    {
+        track.count = 0;
+        track.overruns = 0;
+        track.maxTime = 0;
+        track.open = false;
+        track.currentRegion = 0;
+        track.displayStart = 0;
+    }
     for (auto& frame : gFrameData)
     {
         frame.frameThreads.resize(MaxThreads);
@@ -117,299 +347,1419 @@ void Init(uint32_t maxEntries)
         }
     }
 
-    gThreadIndexTLS = 0;
-    gGenerationTLS = 0;
-    gThreadData[0].initialized = true;
-    gRestarting = true;
+    // Anything still in the rings was timed against the old start
+    for (auto& pRing : gRings)
+    {
+        pRing->read.store(pRing->write.load(std::memory_order_acquire), std::memory_order_release);
+    }
+    gPendingFrames.clear();
+    gZoneStats.clear();
+
     gCurrentFrame = 0;
-    gCurrentRegion = 0;
     gMaxFrameTime = duration_cast<nanoseconds>(milliseconds(30)).count();
     gVisibleFrames = NVec2<uint32_t>(0, 0);
     gFrameCandleRange = NVec2f(0, 0);
     gFrameDisplayStart = 0;
-    gRegionDisplayStart = 0;
     gMaxThreadNameSize = 0.0f;
-    timer_start(gTimer);
+    gStartTicks = timer_get_ticks();
 
     gPaused = false;
 }
 
-void InitThread()
+} // namespace
+
+// Run Init every time a profile is started; maxEntries is per thread, zero for the default
+void Init(uint32_t maxEntries)
 {
+    // Once per process; this takes a few milliseconds
+    timer_calibrate_ticks();
+
     std::unique_lock<std::mutex> lk(gMutex);
+    gMaxEntriesPerThread = maxEntries != 0 ? maxEntries : DefaultEntriesPerThread;
+    InitData();
+    gCollector.Start();
+}
+
+void SetContinuousCapture(bool continuous)
+{
+    gContinuous = continuous;
+}
 
-    for (uint32_t iThread = 0; iThread < MaxThreads; iThread++)
+void VisitThreads(const std::function<void(const ThreadData&)>& fnVisit)
+{
+    std::unique_lock<std::mutex> lk(gMutex);
+    for (auto& threadData : gThreadData)
     {
-        ThreadData* threadData = &gThreadData[iThread];
-        if (!threadData->initialized)
+        if (threadData.initialized)
         {
-            // use it
-            gThreadIndexTLS = iThread;
-            gGenerationTLS = gProfilerGeneration;
-            threadData->currentEntry = 0;
-            threadData->initialized = true;
-            return;
+            fnVisit(threadData);
         }
     }
-    assert(false && "Every thread slots are used!");
 }
 
-void FinishThread()
+namespace
+{
+
+// Called once per thread, the first time it records something
+ThreadRing* InitThread()
 {
+    if (gThreadExitedTLS)
+    {
+        return nullptr;
+    }
+
     std::unique_lock<std::mutex> lk(gMutex);
-    assert(gThreadIndexTLS > -1 && "Trying to finish an uninitilized thread.");
-    gThreadData[gThreadIndexTLS].initialized = false;
-    gThreadIndexTLS = -1;
+    ThreadRing* pRing = nullptr;
+    if (!gFreeRings.empty())
+    {
+        pRing = gFreeRings.back();
+        gFreeRings.pop_back();
+        pRing->free = false;
+        pRing->exited = false;
+        pRing->hidden = false;
+        pRing->droppedDepth = 0;
+        pRing->dropped = 0;
+    }
+    else
+    {
+        if (gRings.size() >= MaxThreads)
+        {
+            assert(false && "Every thread slots are used!");
+            return nullptr;
+        }
+
+        gRings.push_back(std::make_unique<ThreadRing>());
+        pRing = gRings.back().get();
+        pRing->threadIndex = uint32_t(gRings.size() - 1);
+    }
+
+    pRing->name = std::string("Thread ") + std::to_string(pRing->threadIndex);
+    if (pRing->threadIndex < gThreadData.size())
+    {
+        auto& threadData = gThreadData[pRing->threadIndex];
+        threadData.initialized = true;
+        threadData.name = pRing->name;
+        threadData.hidden = false;
+        threadData.callStackDepth = 0;
+    }
+
+    gThreadRingOwner.pRing = pRing;
+    gThreadRingTLS = pRing;
+    return pRing;
+}
+
+ThreadRing* GetThreadRing()
+{
+    if (gThreadRingTLS == nullptr)
+    {
+        return InitThread();
+    }
+    return gThreadRingTLS;
+}
+
+// Write a record to this thread's ring
+bool Record(RecordType type, uint32_t location = 0)
+{
+    if (gPaused)
+    {
+        return false;
+    }
+
+    auto pRing = GetThreadRing();
+    if (!pRing)
+    {
+        return false;
+    }
+
+    // Only ends may use the headroom, so an end is always recorded if its begin was
+    const auto headroom = type == RecordType::End ? 0 : RingHeadroom;
+    return pRing->Push(ProfilerRecord{ type, location, int64_t(timer_get_ticks() - gStartTicks) }, headroom);
+}
+
+} // namespace
+
+uint32_t InternLocation(SourceLocation& location)
+{
+    auto id = location.id.load(std::memory_order_acquire);
+    if (id != 0)
+    {
+        return id;
+    }
+
+    std::unique_lock<std::mutex> lk(gLocationMutex);
+    id = location.id.load(std::memory_order_relaxed);
+    if (id == 0)
+    {
+        id = gLocationCount.load(std::memory_order_relaxed);
+        if (id >= MaxLocations)
+        {
+            return 0;
+        }
+        gLocations[id] = &location;
+        gLocationCount.store(id + 1, std::memory_order_release);
+        location.id.store(id, std::memory_order_release);
+    }
+    return id;
+}
+
+const SourceLocation& GetLocation(uint32_t id)
+{
+    if (id >= gLocationCount.load(std::memory_order_acquire))
+    {
+        return gUnknownLocation;
+    }
+    return *gLocations[id];
 }
 
 void Finish()
 {
+    gPaused = true;
+    gCollector.Stop();
+
+    std::unique_lock<std::mutex> lk(gMutex);
     gThreadData.clear();
 }
 
-ThreadData* GetThreadData()
+void HideThread()
 {
-    if (gGenerationTLS != gProfilerGeneration.load())
+    if (gPaused)
     {
-        gThreadIndexTLS = -1;
+        return;
     }
 
-    if (gThreadIndexTLS == -1)
+    auto pRing = GetThreadRing();
+    if (!pRing)
     {
-        InitThread();
+        return;
     }
 
-    return &gThreadData[gThreadIndexTLS];
+    std::unique_lock<std::mutex> lk(gMutex);
+    pRing->hidden = true;
+    if (pRing->threadIndex < gThreadData.size())
+    {
+        gThreadData[pRing->threadIndex].hidden = true;
+    }
 }
 
-void HideThread()
+void Reset()
+{
+    std::unique_lock<std::mutex> lk(gMutex);
+    InitData();
+}
+
+void PushSection(SourceLocation& location)
+{
+    if (!Record(RecordType::Begin, InternLocation(location)))
+    {
+        // Drop the matching end too
+        if (gThreadRingTLS)
+        {
+            gThreadRingTLS->droppedDepth++;
+        }
+    }
+}
+
+// For callers without a static location; the strings are expected to live as long as the profiler
+void PushSectionBase(const char* szSection, unsigned int color, const char* szFile, int line, uint32_t flags)
+{
+    assert(szSection != NULL && "No section name specified");
+    if (gPaused)
+    {
+        // Still need to match the pop
+        PushSection(gUnknownLocation);
+        return;
+    }
+
+    auto key = DynamicKey{ szSection, szFile ? szFile : "", line, color, flags };
+    auto itr = gDynamicLocationsTLS.find(key);
+    if (itr == gDynamicLocationsTLS.end())
+    {
+        std::unique_lock<std::mutex> lk(gLocationMutex);
+        auto& pLocation = gDynamicLocations[key];
+        if (!pLocation)
+        {
+            pLocation = std::make_unique<SourceLocation>();
+            pLocation->szSection = key.szSection;
+            pLocation->szFile = key.szFile;
+            pLocation->line = line;
+            pLocation->color = color;
+            pLocation->flags = flags;
+        }
+        itr = gDynamicLocationsTLS.emplace(key, pLocation.get()).first;
+    }
+    PushSection(*itr->second);
+}
+
+void PopSection()
+{
+    if (gThreadRingTLS && gThreadRingTLS->droppedDepth > 0)
+    {
+        gThreadRingTLS->droppedDepth--;
+        return;
+    }
+    Record(RecordType::End);
+}
+
+namespace
+{
+
+// Called with the lock held
+uint32_t FindRegionTrack(const char* pszName)
+{
+    for (uint32_t index = 0; index < gRegionTracks.size(); index++)
+    {
+        if (gRegionTracks[index].name == pszName)
+        {
+            return index;
+        }
+    }
+
+    gRegionTracks.emplace_back();
+    gRegionTracks.back().name = pszName;
+    gRegionTracks.back().regions.resize(MaxRegions);
+    return uint32_t(gRegionTracks.size() - 1);
+}
+
+RegionTrack& GetRegionTrack(uint32_t location)
+{
+    auto itr = gRegionTrackLookup.find(location);
+    if (itr == gRegionTrackLookup.end())
+    {
+        itr = gRegionTrackLookup.emplace(location, FindRegionTrack(GetLocation(location).szSection)).first;
+    }
+    return gRegionTracks[itr->second];
+}
+
+} // namespace
+
+void SetRegionLimit(uint64_t maxTimeNs)
+{
+    SetRegionBudget(gDefaultRegionLocation.szSection, maxTimeNs);
+}
+
+void SetRegionBudget(const char* pszName, uint64_t budgetNs)
+{
+    std::unique_lock<std::mutex> lk(gMutex);
+    gRegionTracks[FindRegionTrack(pszName)].budget = int64_t(budgetNs);
+}
+
+std::vector<RegionStats> GetRegionStats()
+{
+    std::unique_lock<std::mutex> lk(gMutex);
+    std::vector<RegionStats> stats;
+    for (auto& track : gRegionTracks)
+    {
+        RegionStats regionStats;
+        regionStats.name = track.name;
+        regionStats.count = track.count;
+        regionStats.overruns = track.overruns;
+        regionStats.budget = track.budget;
+        regionStats.maxTime = track.maxTime;
+        stats.push_back(regionStats);
+    }
+    return stats;
+}
+
+void NameThread(const char* pszName)
 {
     if (gPaused)
     {
-        return;
+        return;
+    }
+
+    // Must get the ring to init the thread
+    auto pRing = GetThreadRing();
+    if (!pRing)
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lk(gMutex);
+    pRing->name = pszName;
+    if (pRing->threadIndex < gThreadData.size())
+    {
+        gThreadData[pRing->threadIndex].name = pszName;
+    }
+}
+
+void BeginRegion()
+{
+    BeginRegion(gDefaultRegionLocation);
+}
+
+void EndRegion()
+{
+    EndRegion(gDefaultRegionLocation);
+}
+
+void BeginRegion(SourceLocation& location)
+{
+    Record(RecordType::RegionBegin, InternLocation(location));
+}
+
+void EndRegion(SourceLocation& location)
+{
+    Record(RecordType::RegionEnd, InternLocation(location));
+}
+
+void SetAllocationTracking(bool track)
+{
+    gTrackAllocations = track;
+}
+
+// Making a ring here would allocate, so threads without one are skipped
+void RecordAllocation(size_t size)
+{
+    if (!gTrackAllocations.load(std::memory_order_relaxed) || !gThreadRingTLS)
+    {
+        return;
+    }
+    Record(RecordType::Alloc, uint32_t(std::min(size, size_t(0xFFFFFFFF))));
+}
+
+void RecordFree(size_t size)
+{
+    if (!gTrackAllocations.load(std::memory_order_relaxed) || !gThreadRingTLS)
+    {
+        return;
+    }
+    Record(RecordType::Free, uint32_t(std::min(size, size_t(0xFFFFFFFF))));
+}
+
+void NewFrame()
+{
+#ifdef MUTILS_PROFILER_TRACY
+    FrameMark;
+#else
+    Record(RecordType::Frame);
+#endif
+}
+
+namespace
+{
+
+// Which histogram bucket a duration falls in
+uint32_t HistogramBucket(int64_t duration)
+{
+    if (duration < HistogramSubBuckets)
+    {
+        return uint32_t(std::max(int64_t(0), duration));
+    }
+
+    // Top bit picks the power of two, the next two bits the quarter within it
+    uint32_t bit = 63;
+    while ((uint64_t(duration) >> bit) == 0)
+    {
+        bit--;
+    }
+    auto sub = uint32_t(uint64_t(duration) >> (bit - 2)) & (HistogramSubBuckets - 1);
+    return std::min(HistogramBuckets - 1, bit * HistogramSubBuckets + sub);
+}
+
+// The middle of the bucket
+int64_t HistogramValue(uint32_t bucket)
+{
+    if (bucket < HistogramSubBuckets)
+    {
+        return bucket;
+    }
+
+    auto bit = bucket / HistogramSubBuckets;
+    auto sub = bucket % HistogramSubBuckets;
+    auto width = int64_t(1) << (bit - 2);
+    return (int64_t(1) << bit) + sub * width + width / 2;
+}
+
+int64_t HistogramPercentile(const ZoneAccumulator& zone, double percentile)
+{
+    // Nudged down so that i.e. 0.99 * 1000 doesn't round up to 991
+    auto target = std::max(uint64_t(1), uint64_t(std::ceil(zone.count * percentile - 1e-6)));
+    uint64_t total = 0;
+    for (uint32_t bucket = 0; bucket < HistogramBuckets; bucket++)
+    {
+        total += zone.histogram[bucket];
+        if (total >= target && total > 0)
+        {
+            return std::clamp(HistogramValue(bucket), zone.minTime, zone.maxTime);
+        }
+    }
+    return zone.maxTime;
+}
+
+void AccumulateZone(uint32_t location, int64_t duration, int64_t exclusive)
+{
+    if (location >= gZoneStats.size())
+    {
+        gZoneStats.resize(location + 1);
+    }
+
+    auto& zone = gZoneStats[location];
+    zone.count++;
+    zone.inclusiveTime += duration;
+    zone.exclusiveTime += exclusive;
+    zone.minTime = std::min(zone.minTime, duration);
+    zone.maxTime = std::max(zone.maxTime, duration);
+    zone.histogram[HistogramBucket(duration)]++;
+}
+
+void AccumulateAllocation(uint32_t location, uint32_t size)
+{
+    if (location >= gZoneStats.size())
+    {
+        gZoneStats.resize(location + 1);
+    }
+
+    auto& zone = gZoneStats[location];
+    zone.allocations++;
+    zone.allocatedBytes += size;
+}
+
+// Open entries end at the end of time
+int64_t EntryEndTime(const ThreadData& thread, uint32_t index)
+{
+    const auto& entry = thread.entries[index];
+    if (entry.duration != ProfilerEntry::LongDuration)
+    {
+        return entry.startTime + entry.duration;
+    }
+
+    auto itr = thread.longEnds.find(index);
+    return itr == thread.longEnds.end() ? std::numeric_limits<int64_t>::max() : itr->second;
+}
+
+// When a buffer is full in continuous mode, the oldest half of it is dropped and the indices into it moved down
+void RollThread(ThreadData& thread, uint32_t threadIndex)
+{
+    const auto cut = thread.currentEntry / 2;
+    std::rotate(thread.entries.begin(), thread.entries.begin() + cut, thread.entries.begin() + thread.currentEntry);
+    thread.currentEntry -= cut;
+
+    std::unordered_map<uint32_t, int64_t> longEnds;
+    for (auto& [index, endTime] : thread.longEnds)
+    {
+        if (index >= cut)
+        {
+            longEnds[index - cut] = endTime;
+        }
+    }
+    thread.longEnds.swap(longEnds);
+
+    // Open sections which were dropped are just not closed
+    for (uint32_t depth = 0; depth < thread.callStackDepth; depth++)
+    {
+        auto& index = thread.entryStack[depth];
+        index = (index == InvalidEntry || index < cut) ? InvalidEntry : index - cut;
+    }
+
+    for (uint32_t frameIndex = 0; frameIndex <= gCurrentFrame && frameIndex < MaxFrames; frameIndex++)
+    {
+        auto& frame = gFrameData[frameIndex];
+        for (uint32_t i = 0; i < frame.frameThreadCount; i++)
+        {
+            auto& info = frame.frameThreads[i];
+            if (info.threadIndex == threadIndex)
+            {
+                info.activeEntry = info.activeEntry < cut ? 0 : info.activeEntry - cut;
+            }
+        }
+    }
+}
+
+void RollFrames()
+{
+    const auto cut = gCurrentFrame / 2;
+    std::rotate(gFrameData.begin(), gFrameData.begin() + cut, gFrameData.begin() + gCurrentFrame);
+    gCurrentFrame -= cut;
+    gFrameDisplayStart = std::max(int64_t(0), gFrameDisplayStart - int64_t(cut));
+    gFrameCandleRange = NVec2f(std::max(float(MinFrame), gFrameCandleRange.x - cut), std::max(float(MinFrame), gFrameCandleRange.y - cut));
+    gVisibleFrames = NVec2i(0, 0);
+}
+
+void RollRegions(RegionTrack& track)
+{
+    const auto cut = track.currentRegion / 2;
+    std::rotate(track.regions.begin(), track.regions.begin() + cut, track.regions.begin() + track.currentRegion);
+    track.currentRegion -= cut;
+    track.displayStart = std::max(int64_t(0), track.displayStart - int64_t(cut));
+}
+
+// A buffer is full; roll it in continuous mode, or stop the capture
+bool MakeRoom(bool full, const std::function<void()>& fnRoll)
+{
+    if (!full)
+    {
+        return true;
+    }
+
+    if (gContinuous)
+    {
+        fnRoll();
+        return true;
+    }
+    gPaused = true;
+    return false;
+}
+
+// Returns false if the capture has filled up
+bool ApplyRecord(ThreadData& threadData, uint32_t threadIndex, RecordType type, uint32_t location, int64_t time)
+{
+    switch (type)
+    {
+    case RecordType::Begin:
+    {
+        if (!MakeRoom(threadData.currentEntry >= gMaxEntriesPerThread, [&]() { RollThread(threadData, threadIndex); }))
+        {
+            return false;
+        }
+
+        assert(threadData.callStackDepth < MaxCallStack && "Might need to make call stack bigger!");
+
+        // Thread buffers grow as they are used
+        if (threadData.currentEntry >= threadData.entries.size())
+        {
+            threadData.entries.resize(std::min(gMaxEntriesPerThread, std::max(InitialEntriesPerThread, uint32_t(threadData.entries.size()) * 2)));
+        }
+
+        ProfilerEntry* profilerEntry = &threadData.entries[threadData.currentEntry];
+        threadData.entryStack[threadData.callStackDepth] = threadData.currentEntry;
+        threadData.childTimeStack[threadData.callStackDepth] = 0;
+
+        profilerEntry->location = location;
+        profilerEntry->startTime = time;
+        profilerEntry->duration = ProfilerEntry::LongDuration;
+        profilerEntry->level = threadData.callStackDepth;
+        threadData.callStackDepth++;
+        threadData.currentEntry++;
+
+        threadData.maxLevel = std::max(threadData.maxLevel, threadData.callStackDepth);
+        threadData.minTime = std::min(profilerEntry->startTime, threadData.minTime);
+        threadData.maxTime = std::max(profilerEntry->startTime, threadData.maxTime);
+    }
+    break;
+    case RecordType::End:
+    {
+        // Sections begun before the capture started
+        if (threadData.callStackDepth == 0)
+        {
+            break;
+        }
+
+        // Back to the last entry we wrote
+        threadData.callStackDepth--;
+        auto entryIndex = threadData.entryStack[threadData.callStackDepth];
+        if (entryIndex == InvalidEntry)
+        {
+            break;
+        }
+
+        ProfilerEntry* profilerEntry = &threadData.entries[entryIndex];
+        auto duration = time - profilerEntry->startTime;
+        if (duration < ProfilerEntry::LongDuration)
+        {
+            profilerEntry->duration = uint32_t(duration);
+        }
+        else
+        {
+            threadData.longEnds[entryIndex] = time;
+        }
+        threadData.maxTime = std::max(time, threadData.maxTime);
+
+        auto exclusive = duration - threadData.childTimeStack[threadData.callStackDepth];
+        if (threadData.callStackDepth > 0)
+        {
+            threadData.childTimeStack[threadData.callStackDepth - 1] += duration;
+        }
+        AccumulateZone(profilerEntry->location, duration, exclusive);
+    }
+    break;
+    case RecordType::Frame:
+        gPendingFrames.push_back(time);
+        break;
+    case RecordType::RegionBegin:
+    {
+        auto& track = GetRegionTrack(location);
+        if (!MakeRoom(track.currentRegion >= MaxRegions, [&]() { RollRegions(track); }))
+        {
+            return false;
+        }
+        track.regions[track.currentRegion].startTime = time;
+        track.open = true;
+    }
+    break;
+    case RecordType::RegionEnd:
+    {
+        // Regions begun before the capture started
+        auto& track = GetRegionTrack(location);
+        if (!track.open)
+        {
+            break;
+        }
+        if (!MakeRoom(track.currentRegion >= MaxRegions, [&]() { RollRegions(track); }))
+        {
+            return false;
+        }
+
+        auto& region = track.regions[track.currentRegion];
+        region.endTime = time;
+        region.name = fmt::format("{:.2f}ms", float(timer_to_ms(region.endTime - region.startTime)));
+
+        const auto duration = region.endTime - region.startTime;
+        track.maxTime = std::max(track.maxTime, duration);
+        track.count++;
+        if (track.budget > 0 && duration > track.budget)
+        {
+            track.overruns++;
+        }
+        track.open = false;
+        track.currentRegion++;
+    }
+    break;
+    case RecordType::Alloc:
+    case RecordType::Free:
+    {
+        // Markers don't stop the capture; the oldest are dropped instead
+        if (threadData.allocations.size() >= MaxAllocationsPerThread)
+        {
+            threadData.allocations.erase(threadData.allocations.begin(), threadData.allocations.begin() + MaxAllocationsPerThread / 2);
+        }
+
+        AllocationMarker marker;
+        marker.time = time;
+        marker.size = location;
+        marker.level = uint16_t(threadData.callStackDepth);
+        marker.free = type == RecordType::Free;
+        threadData.allocations.push_back(marker);
+
+        // Charged to the innermost open zone
+        if (type == RecordType::Alloc && threadData.callStackDepth > 0)
+        {
+            auto entryIndex = threadData.entryStack[threadData.callStackDepth - 1];
+            if (entryIndex != InvalidEntry)
+            {
+                AccumulateAllocation(threadData.entries[entryIndex].location, location);
+            }
+        }
+    }
+    break;
+    }
+    return true;
+}
+
+bool ApplyFrame(int64_t time)
+{
+    if (!MakeRoom(gCurrentFrame >= MaxFrames, RollFrames))
+    {
+        return false;
+    }
+
+    auto& frame = gFrameData[gCurrentFrame];
+    frame.frameThreadCount = 0;
+    for (uint32_t threadIndex = 0; threadIndex < MaxThreads; threadIndex++)
+    {
+        auto& thread = gThreadData[threadIndex];
+        if (!thread.initialized)
+        {
+            continue;
+        }
+        if (thread.currentEntry > 0)
+        {
+            // Remember which entry was active for this thread
+            auto& threadInfo = frame.frameThreads[frame.frameThreadCount];
+            threadInfo.activeEntry = thread.currentEntry - 1;
+            threadInfo.threadIndex = threadIndex;
+
+            // Next thread
+            frame.frameThreadCount++;
+        }
+    }
+
+    frame.startTime = time;
+    if (gCurrentFrame > 0)
+    {
+        gFrameData[gCurrentFrame - 1].endTime = frame.startTime;
+        gFrameData[gCurrentFrame - 1].name = fmt::format("{:.2f}ms", float(timer_to_ms(frame.startTime - gFrameData[gCurrentFrame - 1].startTime)));
+    }
+    gCurrentFrame++;
+    return true;
+}
+
+// Capture files are a header, then a stream of tagged records, with the integers as LEB128 varints.
+// Times are signed deltas from the previous record's time, in nanoseconds.
+// Locations and threads are described before they are first used; threads again at the end, for their final names.
+const char CaptureMagic[] = { 'M', 'U', 'P', 'R', 'O', 'F' };
+const uint8_t CaptureVersion = 3;
+
+enum class CaptureTag : uint8_t
+{
+    Begin = uint8_t(RecordType::Begin),
+    End = uint8_t(RecordType::End),
+    Frame = uint8_t(RecordType::Frame),
+    RegionBegin = uint8_t(RecordType::RegionBegin),
+    RegionEnd = uint8_t(RecordType::RegionEnd),
+    Location,
+    Thread
+};
+
+struct CaptureWriter
+{
+    FILE* pFile = nullptr;
+    std::vector<uint8_t> buffer;
+    int64_t lastTime = 0;
+    std::vector<bool> locationsWritten;
+    std::vector<bool> threadsWritten;
+
+    // The user's setting, put back when the capture ends
+    bool wasContinuous = false;
+
+    void Varint(uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            buffer.push_back(uint8_t(value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(uint8_t(value));
+    }
+
+    void Signed(int64_t value)
+    {
+        Varint((uint64_t(value) << 1) ^ uint64_t(value >> 63));
+    }
+
+    void String(const char* psz)
+    {
+        auto len = strlen(psz);
+        Varint(len);
+        buffer.insert(buffer.end(), psz, psz + len);
+    }
+
+    void Time(int64_t time)
+    {
+        Signed(time - lastTime);
+        lastTime = time;
+    }
+
+    void Thread(uint32_t threadIndex)
+    {
+        auto& thread = gThreadData[threadIndex];
+        buffer.push_back(uint8_t(CaptureTag::Thread));
+        Varint(threadIndex);
+        buffer.push_back(thread.hidden ? 1 : 0);
+        String(thread.name.c_str());
+        if (threadsWritten.size() <= threadIndex)
+        {
+            threadsWritten.resize(threadIndex + 1);
+        }
+        threadsWritten[threadIndex] = true;
+    }
+
+    void Location(uint32_t id)
+    {
+        if (locationsWritten.size() <= id)
+        {
+            locationsWritten.resize(id + 1);
+        }
+        else if (locationsWritten[id])
+        {
+            return;
+        }
+        locationsWritten[id] = true;
+
+        auto& location = GetLocation(id);
+        buffer.push_back(uint8_t(CaptureTag::Location));
+        Varint(id);
+        Signed(location.line);
+        Varint(location.color);
+        Varint(location.flags);
+        String(location.szSection);
+        String(location.szFile ? location.szFile : "");
+    }
+
+    void Record(RecordType type, uint32_t threadIndex, uint32_t location, int64_t time)
+    {
+        switch (type)
+        {
+        case RecordType::Begin:
+            if (threadIndex >= threadsWritten.size() || !threadsWritten[threadIndex])
+            {
+                Thread(threadIndex);
+            }
+            Location(location);
+            buffer.push_back(uint8_t(type));
+            Varint(threadIndex);
+            Varint(location);
+            break;
+        case RecordType::End:
+            buffer.push_back(uint8_t(type));
+            Varint(threadIndex);
+            break;
+        case RecordType::RegionBegin:
+        case RecordType::RegionEnd:
+            Location(location);
+            buffer.push_back(uint8_t(type));
+            Varint(location);
+            break;
+        default:
+            buffer.push_back(uint8_t(type));
+            break;
+        }
+        Time(time);
+    }
+
+    void Flush()
+    {
+        if (pFile && !buffer.empty())
+        {
+            fwrite(buffer.data(), 1, buffer.size(), pFile);
+        }
+        buffer.clear();
+    }
+};
+
+CaptureWriter gCapture;
+
+// Move everything the threads have recorded into the display data, and the capture file
+void Collect()
+{
+    std::unique_lock<std::mutex> lk(gMutex);
+    if (gThreadData.empty())
+    {
+        return;
+    }
+
+    for (auto& pRing : gRings)
+    {
+        if (pRing->free)
+        {
+            continue;
+        }
+
+        // Read before the records, so an exited thread's ring is only freed once its last record is in
+        const bool exited = pRing->exited.load(std::memory_order_acquire);
+        auto r = pRing->read.load(std::memory_order_relaxed);
+        const auto w = pRing->write.load(std::memory_order_acquire);
+        auto& threadData = gThreadData[pRing->threadIndex];
+        for (; r != w && !gPaused; r++)
+        {
+            auto& record = pRing->records[r & (RingSize - 1)];
+
+            // Threads only read the raw ticks; they become display time here, off the hot path
+            const auto time = timer_ticks_to_ns(record.time);
+            // Allocations are not part of the capture format
+            if (gCapture.pFile && record.type != RecordType::Frame && record.type != RecordType::Alloc && record.type != RecordType::Free)
+            {
+                gCapture.Record(record.type, pRing->threadIndex, record.location, time);
+            }
+
+            if (!ApplyRecord(threadData, pRing->threadIndex, record.type, record.location, time))
+            {
+                break;
+            }
+        }
+
+        // Paused: the rest are thrown away
+        pRing->read.store(w, std::memory_order_release);
+
+        if (exited)
+        {
+            pRing->free = true;
+            gFreeRings.push_back(pRing.get());
+        }
+    }
+
+    for (auto time : gPendingFrames)
+    {
+        if (gCapture.pFile)
+        {
+            gCapture.Record(RecordType::Frame, 0, 0, time);
+        }
+
+        if (gPaused || !ApplyFrame(time))
+        {
+            break;
+        }
+    }
+    gPendingFrames.clear();
+    gCapture.Flush();
+}
+
+void CollectorMain()
+{
+    while (gCollector.running)
+    {
+        Collect();
+        std::this_thread::sleep_for(CollectorInterval);
+    }
+}
+
+// Locations read from a capture file; they live as long as the process, like the static ones.
+// Shared by every capture loaded, so reloading doesn't fill the location table
+struct LoadedLocation
+{
+    std::string section;
+    std::string file;
+    SourceLocation location;
+};
+using LoadedKey = std::tuple<std::string, std::string, int, uint32_t, uint32_t>;
+std::map<LoadedKey, std::unique_ptr<LoadedLocation>> gLoadedLocations;
+
+struct CaptureReader
+{
+    const uint8_t* pData;
+    const uint8_t* pEnd;
+    bool ok = true;
+
+    uint64_t Varint()
+    {
+        uint64_t value = 0;
+        for (uint32_t shift = 0; shift < 64; shift += 7)
+        {
+            if (pData == pEnd)
+            {
+                ok = false;
+                return 0;
+            }
+            auto byte = *pData++;
+            value |= uint64_t(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return value;
+            }
+        }
+        ok = false;
+        return 0;
+    }
+
+    int64_t Signed()
+    {
+        auto value = Varint();
+        return int64_t(value >> 1) ^ -int64_t(value & 1);
+    }
+
+    std::string String()
+    {
+        auto len = Varint();
+        if (!ok || len > uint64_t(pEnd - pData))
+        {
+            ok = false;
+            return std::string();
+        }
+        std::string str((const char*)pData, size_t(len));
+        pData += len;
+        return str;
     }
-    ThreadData* threadData = GetThreadData();
-    threadData->hidden = true;
-}
+};
 
-void Reset()
-{
-    std::unique_lock<std::mutex> lk(gMutex);
-    gThreadIndexTLS = -1;
-    Init(MaxEntriesPerThread);
-}
+} // namespace
 
-bool CheckEndState()
+bool BeginCapture(const char* pszPath)
 {
-    if (gThreadData[gThreadIndexTLS].currentEntry >= MaxEntriesPerThread)
+    std::unique_lock<std::mutex> lk(gMutex);
+    if (gCapture.pFile)
     {
-        gPaused = true;
+        return false;
     }
 
-    if (gCurrentFrame >= MaxFrames)
+    gCapture.pFile = fopen(pszPath, "wb");
+    if (!gCapture.pFile)
     {
-        gPaused = true;
+        return false;
     }
 
-    if (gCurrentRegion >= MaxRegions)
-    {
-        gPaused = true;
-    }
-    return gPaused;
+    gCapture.lastTime = 0;
+    gCapture.locationsWritten.clear();
+    gCapture.threadsWritten.clear();
+    gCapture.buffer.insert(gCapture.buffer.end(), std::begin(CaptureMagic), std::end(CaptureMagic));
+    gCapture.buffer.push_back(CaptureVersion);
+    gCapture.Flush();
+
+    // A capture is for long runs, so don't stop when the display fills up
+    gCapture.wasContinuous = gContinuous;
+    gContinuous = true;
+    return true;
 }
 
-void PushSectionBase(const char* szSection, unsigned int color, const char* szFile, int line)
+void EndCapture()
 {
-    if (gPaused)
+    std::unique_lock<std::mutex> lk(gMutex);
+    if (!gCapture.pFile)
     {
         return;
     }
 
-    ThreadData* threadData = GetThreadData();
-    if (CheckEndState())
+    // Threads are often named after they started
+    for (uint32_t threadIndex = 0; threadIndex < gCapture.threadsWritten.size(); threadIndex++)
     {
-        return;
+        if (gCapture.threadsWritten[threadIndex] && threadIndex < gThreadData.size())
+        {
+            gCapture.Thread(threadIndex);
+        }
     }
+    gCapture.Flush();
 
-    assert(threadData->callStackDepth < MaxCallStack && "Might need to make call stack bigger!");
+    fclose(gCapture.pFile);
+    gCapture.pFile = nullptr;
+    gContinuous = gCapture.wasContinuous;
+}
 
-    // check again
-    if (gPaused)
+bool LoadCapture(const char* pszPath)
+{
+    std::ifstream in(pszPath, std::ios::in | std::ios::binary);
+    if (!in)
     {
-        return;
+        return false;
     }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
 
-    // Write entry 0
-    ProfilerEntry* profilerEntry = &threadData->entries[threadData->currentEntry];
-    threadData->entryStack[threadData->callStackDepth] = threadData->currentEntry;
-
-    if (threadData->callStackDepth > 0)
-    {
-        profilerEntry->parent = threadData->entryStack[threadData->callStackDepth - 1];
-        assert(profilerEntry->parent < threadData->currentEntry);
-    }
-    else
+    if (data.size() < sizeof(CaptureMagic) + 1 || memcmp(data.data(), CaptureMagic, sizeof(CaptureMagic)) != 0 || data[sizeof(CaptureMagic)] != CaptureVersion)
     {
-        profilerEntry->parent = 0xFFFFFFFF;
+        return false;
     }
 
-    assert(szFile != NULL && "No file string specified");
-    assert(szSection != NULL && "No section name specified");
-
-    profilerEntry->color = color;
-    profilerEntry->szFile = szFile;
-    profilerEntry->szSection = szSection;
-    profilerEntry->line = line;
-    profilerEntry->startTime = timer_get_elapsed(gTimer);
-    profilerEntry->endTime = std::numeric_limits<int64_t>::max();
-    profilerEntry->level = threadData->callStackDepth;
-    threadData->callStackDepth++;
-    threadData->currentEntry++;
+    std::unique_lock<std::mutex> lk(gMutex);
+    InitData();
 
-    threadData->maxLevel = std::max(threadData->maxLevel, threadData->callStackDepth);
+    // Browse only; live records are dropped while we show the file
+    gPaused = true;
 
-    threadData->minTime = std::min(profilerEntry->startTime, threadData->minTime);
-    threadData->maxTime = std::max(profilerEntry->startTime, threadData->maxTime);
+    // Keep the end of captures longer than the display
+    bool continuous = gContinuous;
+    gContinuous = true;
 
-    if (gRestarting)
+    CaptureReader reader{ data.data() + sizeof(CaptureMagic) + 1, data.data() + data.size() };
+    std::unordered_map<uint64_t, uint32_t> locationMap;
+    int64_t time = 0;
+    while (reader.ok && reader.pData != reader.pEnd)
     {
-        gRestarting = false;
+        auto tag = CaptureTag(*reader.pData++);
+        switch (tag)
+        {
+        case CaptureTag::Location:
+        {
+            auto id = reader.Varint();
+            auto line = int(reader.Signed());
+            auto color = uint32_t(reader.Varint());
+            auto flags = uint32_t(reader.Varint());
+            auto section = reader.String();
+            auto file = reader.String();
+            if (!reader.ok)
+            {
+                break;
+            }
+
+            auto& pLoaded = gLoadedLocations[LoadedKey{ section, file, line, color, flags }];
+            if (!pLoaded)
+            {
+                pLoaded = std::make_unique<LoadedLocation>();
+                pLoaded->section = section;
+                pLoaded->file = file;
+                pLoaded->location.szSection = pLoaded->section.c_str();
+                pLoaded->location.szFile = pLoaded->file.c_str();
+                pLoaded->location.line = line;
+                pLoaded->location.color = color;
+                pLoaded->location.flags = flags;
+            }
+            locationMap[id] = InternLocation(pLoaded->location);
+        }
+        break;
+        case CaptureTag::Thread:
+        {
+            auto threadIndex = reader.Varint();
+            bool hidden = reader.pData != reader.pEnd && *reader.pData++ != 0;
+            auto name = reader.String();
+            if (threadIndex < MaxThreads)
+            {
+                gThreadData[threadIndex].initialized = true;
+                gThreadData[threadIndex].hidden = hidden;
+                gThreadData[threadIndex].name = name;
+            }
+        }
+        break;
+        case CaptureTag::Begin:
+        case CaptureTag::End:
+        {
+            auto threadIndex = reader.Varint();
+            uint32_t location = 0;
+            if (tag == CaptureTag::Begin)
+            {
+                auto itr = locationMap.find(reader.Varint());
+                location = itr == locationMap.end() ? 0 : itr->second;
+            }
+            time += reader.Signed();
+            if (threadIndex < MaxThreads)
+            {
+                ApplyRecord(gThreadData[threadIndex], uint32_t(threadIndex), RecordType(tag), location, time);
+            }
+        }
+        break;
+        case CaptureTag::Frame:
+            time += reader.Signed();
+            ApplyFrame(time);
+            break;
+        case CaptureTag::RegionBegin:
+        case CaptureTag::RegionEnd:
+        {
+            auto itr = locationMap.find(reader.Varint());
+            auto location = itr == locationMap.end() ? InternLocation(gDefaultRegionLocation) : itr->second;
+            time += reader.Signed();
+            ApplyRecord(gThreadData[0], 0, RecordType(tag), location, time);
+        }
+        break;
+        default:
+            reader.ok = false;
+            break;
+        }
     }
+
+    gContinuous = continuous;
+    return reader.ok;
 }
 
-void PopSection()
+namespace
 {
-    if (gPaused)
-    {
-        return;
-    }
 
-    ThreadData* threadData = GetThreadData();
-    if (CheckEndState())
+std::vector<ZoneStats> GetZoneStatsLocked()
+{
+    std::vector<ZoneStats> stats;
+    for (uint32_t location = 0; location < gZoneStats.size(); location++)
     {
-        return;
-    }
-
+        auto& zone = gZoneStats[location];
+        if (zone.count == 0)
+        {
+            continue;
+        }
 
-    if (gRestarting || gPaused)
-    {
-        return;
+        ZoneStats zoneStats;
+        zoneStats.location = location;
+        zoneStats.count = zone.count;
+        zoneStats.inclusiveTime = zone.inclusiveTime;
+        zoneStats.exclusiveTime = zone.exclusiveTime;
+        zoneStats.minTime = zone.minTime;
+        zoneStats.maxTime = zone.maxTime;
+        zoneStats.p50 = HistogramPercentile(zone, 0.5);
+        zoneStats.p99 = HistogramPercentile(zone, 0.99);
+        zoneStats.allocations = zone.allocations;
+        zoneStats.allocatedBytes = zone.allocatedBytes;
+        stats.push_back(zoneStats);
     }
 
-    if (threadData->callStackDepth <= 0)
+    std::sort(stats.begin(), stats.end(), [](const ZoneStats& lhs, const ZoneStats& rhs) { return lhs.inclusiveTime > rhs.inclusiveTime; });
+    return stats;
+}
+
+// JSON strings; names and paths are the only text in a trace
+std::string JsonEscape(const char* psz)
+{
+    std::string str;
+    for (; *psz; psz++)
     {
-        return;
+        auto ch = *psz;
+        switch (ch)
+        {
+        case '"':
+            str += "\\\"";
+            break;
+        case '\\':
+            str += "\\\\";
+            break;
+        default:
+            if (uint8_t(ch) < 0x20)
+            {
+                str += fmt::format("\\u{:04x}", int(ch));
+            }
+            else
+            {
+                str += ch;
+            }
+            break;
+        }
     }
+    return str;
+}
 
-    // Back to the last entry we wrote
-    threadData->callStackDepth--;
-
-    int entryIndex = threadData->entryStack[threadData->callStackDepth];
-    ProfilerEntry* profilerEntry = &threadData->entries[entryIndex];
-
-    assert(profilerEntry->szSection != nullptr);
-
-    // store end time
-    profilerEntry->endTime = timer_get_elapsed(gTimer);
+} // namespace
 
-    threadData->maxTime = std::max(profilerEntry->endTime, threadData->maxTime);
+std::vector<ZoneStats> GetZoneStats()
+{
+    std::unique_lock<std::mutex> lk(gMutex);
+    return GetZoneStatsLocked();
 }
 
-void SetRegionLimit(uint64_t maxTimeNs)
+void ResetZoneStats()
 {
-    gRegionTimeLimit = maxTimeNs;
+    std::unique_lock<std::mutex> lk(gMutex);
+    gZoneStats.clear();
 }
 
-void NameThread(const char* pszName)
+void RegisterLockSite(LockSite& site)
 {
-    if (gPaused)
+    bool registered = false;
+    if (!site.registered.compare_exchange_strong(registered, true))
     {
         return;
     }
 
-    // Must get thread data to init the thread
-    ThreadData* threadData = GetThreadData();
-    threadData->name = pszName;
+    auto pHead = gLockSites.load();
+    do
+    {
+        site.pNext = pHead;
+    } while (!gLockSites.compare_exchange_weak(pHead, &site));
 }
 
-// You are allowed one secondary region - I use it for audio thread monitoring
-void BeginRegion()
+std::vector<LockStats> GetLockStats(size_t maxCount)
 {
-    if (gPaused)
+    std::vector<LockStats> stats;
+    for (auto pSite = gLockSites.load(); pSite; pSite = pSite->pNext)
     {
-        return; 
+        LockStats lockStats;
+        lockStats.location = pSite->pLocation;
+        lockStats.count = pSite->acquisitions.load(std::memory_order_relaxed);
+        lockStats.contended = pSite->contended.load(std::memory_order_relaxed);
+        lockStats.totalWait = timer_ticks_to_ns(pSite->waitTicks.load(std::memory_order_relaxed));
+        lockStats.maxWait = timer_ticks_to_ns(pSite->maxWaitTicks.load(std::memory_order_relaxed));
+        lockStats.totalHold = timer_ticks_to_ns(pSite->holdTicks.load(std::memory_order_relaxed));
+        lockStats.maxHold = timer_ticks_to_ns(pSite->maxHoldTicks.load(std::memory_order_relaxed));
+        stats.push_back(lockStats);
     }
 
-    // Must get thread data to init the thread
-    ThreadData* threadData = GetThreadData();
-    if (CheckEndState())
+    std::stable_sort(stats.begin(), stats.end(), [](const LockStats& lhs, const LockStats& rhs) { return lhs.totalWait > rhs.totalWait; });
+    if (stats.size() > maxCount)
     {
-        return;
+        stats.resize(maxCount);
     }
-
-    auto& region = gRegionData[gCurrentRegion];
-    region.startTime = timer_get_elapsed(gTimer);
+    return stats;
 }
 
-void EndRegion()
+// Counts taken while this runs may be lost
+void ResetLockStats()
 {
-    if (gPaused)
+    for (auto pSite = gLockSites.load(); pSite; pSite = pSite->pNext)
     {
-        return;
+        for (auto pCounter : { &pSite->acquisitions, &pSite->contended, &pSite->waitTicks, &pSite->maxWaitTicks, &pSite->holdTicks, &pSite->maxHoldTicks })
+        {
+            pCounter->store(0, std::memory_order_relaxed);
+        }
     }
+}
 
-    ThreadData* threadData = GetThreadData();
-    if (CheckEndState())
+void DumpLockStats(size_t maxCount, FILE* pFile)
+{
+    fmt::print(pFile, "{:<24} {:>10} {:>10} {:>12} {:>12} {:>12} {:>12}  Location\n", "Lock", "Count", "Contended", "Wait ms", "Max wait us", "Hold ms", "Max hold us");
+    for (auto& lock : GetLockStats(maxCount))
     {
-        return;
+        fmt::print(pFile, "{:<24} {:>10} {:>10} {:>12.3f} {:>12.2f} {:>12.3f} {:>12.2f}  {}({})\n",
+            lock.location->szSection,
+            lock.count,
+            lock.contended,
+            lock.totalWait / 1000000.0,
+            lock.maxWait / 1000.0,
+            lock.totalHold / 1000000.0,
+            lock.maxHold / 1000.0,
+            lock.location->szFile,
+            lock.location->line);
     }
-
-    auto& region = gRegionData[gCurrentRegion];
-    region.endTime = timer_get_elapsed(gTimer);
-    region.name = fmt::format("{:.2f}ms", float(timer_to_ms(region.endTime - region.startTime)));
-
-    gCurrentRegion++;
 }
 
-void NewFrame()
+bool ExportChromeTrace(const char* pszPath)
 {
-    if (gPaused)
+    FILE* pFile = fopen(pszPath, "wb");
+    if (!pFile)
     {
-        return;
+        return false;
     }
 
-    if (CheckEndState())
-    {
-        return;
-    }
+    std::unique_lock<std::mutex> lk(gMutex);
 
-    auto& frame = gFrameData[gCurrentFrame];
-    for (uint32_t threadIndex = 0; threadIndex < MaxThreads; threadIndex++)
+    // Frames and region tracks go on their own tracks, after the threads
+    const uint32_t FrameTrack = MaxThreads;
+    const uint32_t FirstRegionTrack = MaxThreads + 1;
+
+    // Trace times are microseconds
+    auto us = [](int64_t ns) {
+        return ns / 1000.0;
+    };
+
+    bool first = true;
+    auto separator = [&]() {
+        auto psz = first ? "\n" : ",\n";
+        first = false;
+        return psz;
+    };
+
+    auto writeTrack = [&](uint32_t track, const std::string& name) {
+        fmt::print(pFile, "{}{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"name\":\"{}\"}}}}", separator(), track, JsonEscape(name.c_str()));
+    };
+
+    fmt::print(pFile, "{{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (uint32_t threadIndex = 0; threadIndex < gThreadData.size(); threadIndex++)
     {
         auto& thread = gThreadData[threadIndex];
-        if (!thread.initialized)
+        if (!thread.initialized || thread.hidden || thread.currentEntry == 0)
         {
             continue;
         }
-        if (thread.currentEntry > 0)
+
+        writeTrack(threadIndex, thread.name);
+        for (uint32_t index = 0; index < thread.currentEntry; index++)
         {
-            // Remember which entry was active for this thread
-            auto& threadInfo = frame.frameThreads[frame.frameThreadCount];
-            threadInfo.activeEntry = thread.currentEntry - 1;
-            threadInfo.threadIndex = threadIndex;
+            auto& entry = thread.entries[index];
+            auto& location = GetLocation(entry.location);
+
+            // Still open; cut at the last thing we saw
+            auto endTime = std::min(EntryEndTime(thread, index), thread.maxTime);
+            fmt::print(pFile, "{}{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}{},\"args\":{{\"file\":\"{}\",\"line\":{}}}}}",
+                separator(),
+                JsonEscape(location.szSection),
+                (location.flags & LocationFlag_Lock) ? "lock" : "zone",
+                threadIndex,
+                us(entry.startTime),
+                us(std::max(int64_t(0), endTime - entry.startTime)),
+                (location.flags & LocationFlag_Lock) ? ",\"cname\":\"terrible\"" : "",
+                JsonEscape(location.szFile),
+                location.line);
+        }
+    }
 
-            // Next thread
-            frame.frameThreadCount++;
+    // The last frame is still running
+    if (gCurrentFrame > 1)
+    {
+        writeTrack(FrameTrack, "Frames");
+        for (uint32_t frameIndex = 0; frameIndex < gCurrentFrame - 1; frameIndex++)
+        {
+            auto& frame = gFrameData[frameIndex];
+            fmt::print(pFile, "{}{{\"name\":\"{}\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}}}",
+                separator(), JsonEscape(frame.name.c_str()), FrameTrack, us(frame.startTime), us(frame.endTime - frame.startTime));
         }
     }
 
-    frame.startTime = timer_get_elapsed(gTimer);
-    if (gCurrentFrame > 0)
+    // Regions over budget are colored like lock waits
+    for (uint32_t trackIndex = 0; trackIndex < gRegionTracks.size(); trackIndex++)
     {
-        gFrameData[gCurrentFrame - 1].endTime = frame.startTime;
-        gFrameData[gCurrentFrame - 1].name = fmt::format("{:.2f}ms", float(timer_to_ms(frame.startTime - gFrameData[gCurrentFrame - 1].startTime)));
+        auto& track = gRegionTracks[trackIndex];
+        if (track.currentRegion == 0)
+        {
+            continue;
+        }
+
+        writeTrack(FirstRegionTrack + trackIndex, track.name);
+        for (uint32_t regionIndex = 0; regionIndex < track.currentRegion; regionIndex++)
+        {
+            auto& region = track.regions[regionIndex];
+            const auto duration = region.endTime - region.startTime;
+            fmt::print(pFile, "{}{{\"name\":\"{}\",\"cat\":\"region\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}{}}}",
+                separator(),
+                JsonEscape(region.name.c_str()),
+                FirstRegionTrack + trackIndex,
+                us(region.startTime),
+                us(duration),
+                (track.budget > 0 && duration > track.budget) ? ",\"cname\":\"terrible\"" : "");
+        }
     }
-    gCurrentFrame++;
+
+    fmt::print(pFile, "\n]}}\n");
+    fclose(pFile);
+    return true;
 }
 
 // Which frames we can see in the main viewport for the current zoom
@@ -556,10 +1906,10 @@ NVec2ll ShowCandles(NVec2f& regionMin, NVec2f& regionMax)
         return changed;
     };
 
+    // Frames, then a row for each region track
     const float CandleHeight = 30 * dpi.scaleFactorXY.y;
     NRectf regionFrames = NRectf(regionMin.x, regionMin.y, regionMax.x - regionMin.x, CandleHeight);
-    NRectf regionRegion = NRectf(regionMin.x, regionMin.y + CandleHeight, regionMax.x - regionMin.x, CandleHeight);
-    NRectf regionBoth = NRectf(regionFrames.topLeftPx, regionRegion.bottomRightPx);
+    NRectf regionBoth = NRectf(regionMin.x, regionMin.y, regionMax.x - regionMin.x, CandleHeight * (1 + gRegionTracks.size()));
 
     handleMouse("##frameButton", regionBoth, gFrameCandleRange, gCurrentFrame);
 
@@ -573,13 +1923,14 @@ NVec2ll ShowCandles(NVec2f& regionMin, NVec2f& regionMax)
     }
 
     NVec2ll dragTimeRange = NVec2ll(0);
-    auto drawRegions = [&dragTimeRange](const auto& region, const auto& framesStartTime, const auto& framesDuration, auto& regionData, auto& regionDisplayStart, const auto& maxTime, const auto& limitTime, const auto& color1, const auto& color2) {
+    // With a budget, candles are only highlighted when they are over it
+    auto drawRegions = [&dragTimeRange](const auto& region, const auto& framesStartTime, const auto& framesDuration, auto& regionData, auto& regionDisplayStart, uint32_t regionCount, const auto& maxTime, const auto& limitTime, bool budget, const auto& color1, const auto& color2) {
         const NVec2f candleRegionSize = region.Size();
         const auto pDrawList = ImGui::GetWindowDrawList();
         const auto LimitColor = ThemeManager::Instance().GetColor(ThemeColor::Error);
 
         auto timePerPixel = framesDuration / int64_t(region.Width());
-        auto MaxRegion = int64_t(gCurrentRegion);
+        auto MaxRegion = int64_t(regionCount);
 
         // Keep global counters to simplify finding the regions
         while (regionDisplayStart > 0 && regionData[regionDisplayStart].startTime > framesStartTime)
@@ -666,8 +2017,11 @@ NVec2ll ShowCandles(NVec2f& regionMin, NVec2f& regionMax)
                     float candleHeight = totalDuration / float(maxTime);
                     candleHeight = std::min(candleHeight, 1.0f);
 
-                    float candleLimit = totalDuration / float(limitTime);
-                    candleLimit = std::clamp(candleLimit, 0.0f, 1.0f);
+                    float candleLimit = 0.0f;
+                    if (limitTime > 0)
+                    {
+                        candleLimit = budget ? (totalDuration > limitTime ? 1.0f : 0.0f) : std::clamp(totalDuration / float(limitTime), 0.0f, 1.0f);
+                    }
 
                     if (lastX == -1)
                     {
@@ -717,11 +2071,28 @@ NVec2ll ShowCandles(NVec2f& regionMin, NVec2f& regionMax)
     const auto framesStartTime = gFrameData[int64_t(gFrameCandleRange.x)].startTime;
     const auto framesDuration = gFrameData[int64_t(gFrameCandleRange.y)].startTime - framesStartTime;
 
-    drawRegions(regionFrames, framesStartTime, framesDuration, gFrameData, gFrameDisplayStart, gMaxFrameTime, gMaxFrameTime, FrameCandleColor, FrameCandleAltColor);
+    // The last frame is still running
+    drawRegions(regionFrames, framesStartTime, framesDuration, gFrameData, gFrameDisplayStart, gCurrentFrame - 1, gMaxFrameTime, gMaxFrameTime, false, FrameCandleColor, FrameCandleAltColor);
     regionMin.y += CandleHeight + 2.0f * dpi.scaleFactorXY.y;
 
-    drawRegions(regionRegion, framesStartTime, framesDuration, gRegionData, gRegionDisplayStart, gRegionTimeLimit, gRegionTimeLimit, RegionCandleColor, RegionCandleAltColor);
-    regionMin.y += CandleHeight;
+    for (auto& track : gRegionTracks)
+    {
+        // Budgets sit half way up; without one, the longest region fills the row
+        NRectf regionTrack = NRectf(regionMin.x, regionMin.y, regionMax.x - regionMin.x, CandleHeight);
+        const auto maxTime = track.budget > 0 ? track.budget * 2 : std::max(track.maxTime, int64_t(1));
+        drawRegions(regionTrack, framesStartTime, framesDuration, track.regions, track.displayStart, track.currentRegion, maxTime, track.budget, true, RegionCandleColor, RegionCandleAltColor);
+
+        const auto pDrawList = ImGui::GetWindowDrawList();
+        if (track.budget > 0)
+        {
+            const float yBudget = regionTrack.Top() + regionTrack.Height() * .5f;
+            pDrawList->AddLine(ImVec2(regionTrack.Left(), yBudget), ImVec2(regionTrack.Right(), yBudget), 0x88FFFFFF);
+        }
+
+        auto label = track.budget > 0 ? fmt::format("{} ({} over {:.2f}ms)", track.name, track.overruns, timer_to_ms(track.budget)) : track.name;
+        pDrawList->AddText(ImVec2(regionTrack.Left() + 2.0f, regionTrack.Top()), track.overruns > 0 ? 0xFF8080FF : 0xFFAAAAAA, label.c_str());
+        regionMin.y += CandleHeight;
+    }
 
     if (dragTimeRange.x > dragTimeRange.y)
     {
@@ -730,6 +2101,157 @@ NVec2ll ShowCandles(NVec2f& regionMin, NVec2f& regionMax)
     return dragTimeRange;
 }
 
+// Counters of the registered memory pools; useful for picking initial pool sizes
+void ShowPoolStats()
+{
+    ImGui::Columns(6, "##PoolStats");
+    for (auto& header : { "Pool", "Live", "Free", "Peak", "Misses", "Reserved" })
+    {
+        ImGui::TextUnformatted(header);
+        ImGui::NextColumn();
+    }
+    ImGui::Separator();
+
+    pool_visit_stats([](const char* pszName, const PoolStats& stats) {
+        ImGui::TextUnformatted(pszName);
+        ImGui::NextColumn();
+        ImGui::Text("%llu", (unsigned long long)stats.liveItems);
+        ImGui::NextColumn();
+        ImGui::Text("%llu", (unsigned long long)stats.freeItems);
+        ImGui::NextColumn();
+        ImGui::Text("%llu", (unsigned long long)stats.peakLiveItems);
+        ImGui::NextColumn();
+        ImGui::Text("%llu", (unsigned long long)stats.misses);
+        ImGui::NextColumn();
+        ImGui::Text("%.1fKB", stats.bytesReserved / 1024.0f);
+        ImGui::NextColumn();
+    });
+    ImGui::Columns(1);
+    ImGui::Separator();
+}
+
+// Per location totals, sorted by clicking a column header; called with the lock held
+void ShowZoneStats()
+{
+    static int sortColumn = 2;
+    auto stats = GetZoneStatsLocked();
+
+    const char* headers[] = { "Zone", "Count", "Inclusive", "Exclusive", "Min", "Max", "p50", "p99", "Allocs", "Bytes" };
+    const int columns = int(sizeof(headers) / sizeof(headers[0]));
+    auto key = [](const ZoneStats& zone, int column) {
+        switch (column)
+        {
+        default:
+        case 1:
+            return int64_t(zone.count);
+        case 2:
+            return zone.inclusiveTime;
+        case 3:
+            return zone.exclusiveTime;
+        case 4:
+            return zone.minTime;
+        case 5:
+            return zone.maxTime;
+        case 6:
+            return zone.p50;
+        case 7:
+            return zone.p99;
+        case 8:
+            return int64_t(zone.allocations);
+        case 9:
+            return int64_t(zone.allocatedBytes);
+        }
+    };
+
+    if (sortColumn == 0)
+    {
+        std::sort(stats.begin(), stats.end(), [](const ZoneStats& lhs, const ZoneStats& rhs) {
+            return strcmp(GetLocation(lhs.location).szSection, GetLocation(rhs.location).szSection) < 0;
+        });
+    }
+    else
+    {
+        std::stable_sort(stats.begin(), stats.end(), [&](const ZoneStats& lhs, const ZoneStats& rhs) { return key(lhs, sortColumn) > key(rhs, sortColumn); });
+    }
+
+    ImGui::Columns(columns, "##ZoneStats");
+    for (int column = 0; column < columns; column++)
+    {
+        if (ImGui::Selectable(headers[column], sortColumn == column))
+        {
+            sortColumn = column;
+        }
+        ImGui::NextColumn();
+    }
+    ImGui::Separator();
+
+    for (auto& zone : stats)
+    {
+        auto& location = GetLocation(zone.location);
+        ImGui::TextUnformatted(location.szSection);
+        if (ImGui::IsItemHovered())
+        {
+            ImGui::SetTooltip("%s (Ln %d)", location.szFile, location.line);
+        }
+        ImGui::NextColumn();
+        ImGui::Text("%llu", (unsigned long long)zone.count);
+        ImGui::NextColumn();
+        ImGui::Text("%.3fms", timer_to_ms(zone.inclusiveTime));
+        ImGui::NextColumn();
+        ImGui::Text("%.3fms", timer_to_ms(zone.exclusiveTime));
+        ImGui::NextColumn();
+        for (auto time : { zone.minTime, zone.maxTime, zone.p50, zone.p99 })
+        {
+            ImGui::Text("%.2fus", time / 1000.0f);
+            ImGui::NextColumn();
+        }
+        ImGui::Text("%llu", (unsigned long long)zone.allocations);
+        ImGui::NextColumn();
+        ImGui::Text("%.1fKB", zone.allocatedBytes / 1024.0f);
+        ImGui::NextColumn();
+    }
+    ImGui::Columns(1);
+    ImGui::Separator();
+}
+
+// Contention per LOCK_GUARD site, worst first
+void ShowLockStats()
+{
+    auto stats = GetLockStats();
+
+    ImGui::Columns(7, "##LockStats");
+    for (auto& header : { "Lock", "Count", "Contended", "Wait", "Max Wait", "Hold", "Max Hold" })
+    {
+        ImGui::TextUnformatted(header);
+        ImGui::NextColumn();
+    }
+    ImGui::Separator();
+
+    for (auto& lock : stats)
+    {
+        ImGui::TextUnformatted(lock.location->szSection);
+        if (ImGui::IsItemHovered())
+        {
+            ImGui::SetTooltip("%s (Ln %d)", lock.location->szFile, lock.location->line);
+        }
+        ImGui::NextColumn();
+        ImGui::Text("%llu", (unsigned long long)lock.count);
+        ImGui::NextColumn();
+        ImGui::Text("%llu", (unsigned long long)lock.contended);
+        ImGui::NextColumn();
+        ImGui::Text("%.3fms", lock.totalWait / 1000000.0f);
+        ImGui::NextColumn();
+        ImGui::Text("%.2fus", lock.maxWait / 1000.0f);
+        ImGui::NextColumn();
+        ImGui::Text("%.3fms", lock.totalHold / 1000000.0f);
+        ImGui::NextColumn();
+        ImGui::Text("%.2fus", lock.maxHold / 1000.0f);
+        ImGui::NextColumn();
+    }
+    ImGui::Columns(1);
+    ImGui::Separator();
+}
+
 // Show the profiler window
 void ShowProfile()
 {
@@ -755,11 +2277,47 @@ void ShowProfile()
 
     ImGui::SameLine();
 
+    // Keep going when the buffers fill, dropping the oldest data
+    bool continuous = gContinuous;
+    if (ImGui::Checkbox("Continuous", &continuous))
+    {
+        gContinuous = continuous;
+    }
+
+    ImGui::SameLine();
+
+    // The collector writes the data we are about to draw
+    std::unique_lock<std::mutex> lk(gMutex);
+
     static float scale = 1.0f;
 
     ImGui::PushItemWidth(100 * dpi.scaleFactorXY.x);
     ImGui::SliderFloat("Scale", &scale, .5f, 1.0f, "%.2f");
 
+    static bool showPools = false;
+    ImGui::SameLine();
+    ImGui::Checkbox("Pools", &showPools);
+    if (showPools)
+    {
+        ShowPoolStats();
+    }
+
+    static bool showZones = false;
+    ImGui::SameLine();
+    ImGui::Checkbox("Zones", &showZones);
+    if (showZones)
+    {
+        ShowZoneStats();
+    }
+
+    static bool showLocks = false;
+    ImGui::SameLine();
+    ImGui::Checkbox("Locks", &showLocks);
+    if (showLocks)
+    {
+        ShowLockStats();
+    }
+
     // Ignore the first frame, which is likely a long delay due to
     // the time that expires after this profiler is created and the first
     // frame is drawn
@@ -826,7 +2384,7 @@ void ShowProfile()
         timePerPixels = 1.0 / pixelsPerTime;
     };
 
-    const auto now = (int64_t)timer_get_elapsed(gTimer);
+    const auto now = timer_ticks_to_ns(int64_t(timer_get_ticks() - gStartTicks));
     if (!gPaused)
     {
         auto duration = duration_cast<nanoseconds>(milliseconds(50)).count();
@@ -952,16 +2510,18 @@ void ShowProfile()
 
             auto showEntry = [&](uint32_t index) {
                 auto& entry = threadData.entries[index];
+                const auto endTime = EntryEndTime(threadData, index);
 
                 // Ignore wholly outside our visible range
-                if (entry.startTime > gTimeRange.y || entry.endTime < gTimeRange.x)
+                if (entry.startTime > gTimeRange.y || endTime < gTimeRange.x)
                 {
                     return;
                 }
 
+                auto& location = GetLocation(entry.location);
                 float yEntry = y + entry.level * heightPerLevel;
                 float xEntry = float(xFromTime(entry.startTime));
-                float xEnd = float(xFromTime(entry.endTime));
+                float xEnd = float(xFromTime(endTime));
 
                 // Avoid alliasing/make it easy to see small entries
                 if (xEnd < (xEntry + 1))
@@ -971,23 +2531,23 @@ void ShowProfile()
 
                 ImVec2 rectMin(std::max(xEntry + regionMin.x, regionMin.x), yEntry);
                 ImVec2 rectMax(std::min(xEnd + regionMin.x, regionMax.x), yEntry + heightPerLevel);
-                pDrawList->AddRectFilled(rectMin, rectMax, entry.color | 0xFF000000);
+                pDrawList->AddRectFilled(rectMin, rectMax, location.color | 0xFF000000);
 
                 if (ImGui::IsMouseHoveringRect(rectMin, rectMax))
                 {
                     auto tip = fmt::format("{}: {:.4f}ms ({:.2f}us)\nRange: {:.4f}ms - {:.4f}ms\n\n{} (Ln {})",
-                        entry.szSection,
-                        timer_to_ms(std::min(entry.endTime, threadData.maxTime) - entry.startTime),
-                        (std::min(entry.endTime, threadData.maxTime) - entry.startTime) / 1000.0f,
+                        location.szSection,
+                        timer_to_ms(std::min(endTime, threadData.maxTime) - entry.startTime),
+                        (std::min(endTime, threadData.maxTime) - entry.startTime) / 1000.0f,
                         timer_to_ms(entry.startTime),
-                        timer_to_ms(entry.endTime),
-                        entry.szFile, entry.line);
+                        timer_to_ms(endTime),
+                        location.szFile, location.line);
                     ImGui::SetTooltip("%s", tip.c_str());
                 }
 
                 float width = rectMax.x - rectMin.x;
                 auto clip = ImVec4(rectMin.x, rectMin.y, rectMax.x, rectMax.y);
-                auto textSize = ImGui::CalcTextSize(entry.szSection);
+                auto textSize = ImGui::CalcTextSize(location.szSection);
 
                 // Center the text if possible
                 float textPos = textPadding.x + rectMin.x;
@@ -998,21 +2558,22 @@ void ShowProfile()
 
                 if (width > MinSizeForTextDisplay)
                 {
-                    pDrawList->AddText(pFont, fontSize, ImVec2(textPos, yEntry + textPadding.y), LuminanceARGB(entry.color) > .5f ? 0xFF000000 : 0xFFFFFFFF, entry.szSection, NULL, 0.0f, &clip);
+                    pDrawList->AddText(pFont, fontSize, ImVec2(textPos, yEntry + textPadding.y), LuminanceARGB(location.color) > .5f ? 0xFF000000 : 0xFFFFFFFF, location.szSection, NULL, 0.0f, &clip);
                 }
             };
 
             // Get the most recent thread entry for this frame
             auto currentEntry = frameThreadInfo.activeEntry;
 
-            // Walk up the stack to find the outer parent; since it might have started before this frame
-            while (threadData.entries[currentEntry].parent != 0xFFFFFFFF)
+            // Walk back to the outer parent; since it might have started before this frame.
+            // Entries are in start order, so it is the nearest one at the top level
+            while (currentEntry > 0 && threadData.entries[currentEntry].level != 0)
             {
-                currentEntry = threadData.entries[currentEntry].parent;
+                currentEntry--;
             }
 
             // Step back to find entries that began before the frame
-            while (currentEntry > 0 && threadData.entries[currentEntry].endTime > frameInfo.startTime)
+            while (currentEntry > 0 && EntryEndTime(threadData, currentEntry) > frameInfo.startTime)
             {
                 currentEntry--;
             }
@@ -1023,6 +2584,23 @@ void ShowProfile()
                 currentEntry++;
             }
 
+            // Allocation markers in this frame, as ticks at the depth they happened
+            auto itrAlloc = std::lower_bound(threadData.allocations.begin(), threadData.allocations.end(), std::max(frameInfo.startTime, gTimeRange.x), [](const AllocationMarker& marker, int64_t time) {
+                return marker.time < time;
+            });
+            for (; itrAlloc != threadData.allocations.end() && itrAlloc->time < frameInfo.endTime && itrAlloc->time <= gTimeRange.y; itrAlloc++)
+            {
+                float xMarker = regionMin.x + float(xFromTime(itrAlloc->time));
+                float yMarker = y + std::min(uint32_t(itrAlloc->level), threadData.maxLevel) * heightPerLevel;
+                ImVec2 markerMin(xMarker - 1.0f, yMarker);
+                ImVec2 markerMax(xMarker + 1.0f, yMarker + heightPerLevel * .5f);
+                pDrawList->AddRectFilled(markerMin, markerMax, itrAlloc->free ? AllocFreeColor : AllocColor);
+                if (ImGui::IsMouseHoveringRect(markerMin, markerMax))
+                {
+                    ImGui::SetTooltip("%s %u bytes\n%.4fms", itrAlloc->free ? "Free" : "Allocation", itrAlloc->size, timer_to_ms(itrAlloc->time));
+                }
+            }
+
             if (firstFrame && mouseClick.y >= y && mouseClick.y <= (y + threadHeight))
             {
                 if (gSelectedThread != threadIndex)
@@ -1052,3 +2630,73 @@ void ShowProfile()
 
 } // namespace Profiler
 } // namespace MUtils
+
+#ifdef MUTILS_PROFILER_ALLOCATIONS
+// Global allocation hooks. Both sides record the C runtime's block size, since unsized frees have nothing else,
+// so the allocated and freed totals balance
+
+void* operator new(std::size_t size)
+{
+    auto p = malloc(size ? size : 1);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    MUtils::Profiler::RecordAllocation(MUTILS_BLOCK_SIZE(p));
+    return p;
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    auto p = malloc(size ? size : 1);
+    if (p)
+    {
+        MUtils::Profiler::RecordAllocation(MUTILS_BLOCK_SIZE(p));
+    }
+    return p;
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept
+{
+    if (p)
+    {
+        MUtils::Profiler::RecordFree(MUTILS_BLOCK_SIZE(p));
+        free(p);
+    }
+}
+
+void operator delete[](void* p) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete[](void* p, std::size_t size) noexcept
+{
+    operator delete(p, size);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    operator delete(p);
+}
+#endif
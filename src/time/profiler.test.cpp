@@ -0,0 +1,434 @@
+#include <catch2/catch.hpp>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <thread>
+
+#include "mutils/time/profiler.h"
+
+using namespace MUtils;
+using namespace MUtils::Profiler;
+using namespace std::chrono;
+namespace fs = std::filesystem;
+
+namespace
+{
+
+// The collector runs every millisecond; give it plenty of time to catch up
+template <typename F>
+bool WaitFor(F&& fn)
+{
+    for (int i = 0; i < 2000; i++)
+    {
+        if (fn())
+        {
+            return true;
+        }
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    return false;
+}
+
+uint64_t CountEntries(const char* pszSection)
+{
+    uint64_t count = 0;
+    VisitThreads([&](const ThreadData& threadData) {
+        for (uint32_t index = 0; index < threadData.currentEntry; index++)
+        {
+            count += strcmp(GetLocation(threadData.entries[index].location).szSection, pszSection) == 0 ? 1 : 0;
+        }
+    });
+    return count;
+}
+
+bool WaitForEntries(const char* pszSection, uint64_t count)
+{
+    return WaitFor([&]() { return CountEntries(pszSection) >= count; });
+}
+
+ZoneStats FindZone(const char* pszSection)
+{
+    for (auto& zone : GetZoneStats())
+    {
+        if (strcmp(GetLocation(zone.location).szSection, pszSection) == 0)
+        {
+            return zone;
+        }
+    }
+    return ZoneStats{};
+}
+
+bool WaitForZone(const char* pszSection, uint64_t count)
+{
+    return WaitFor([&]() { return FindZone(pszSection).count >= count; });
+}
+
+// Sleeping could take much longer than asked
+void BusyWait(int64_t ns)
+{
+    auto end = steady_clock::now() + nanoseconds(ns);
+    while (steady_clock::now() < end)
+    {
+    }
+}
+
+void RecordZones(SourceLocation& location, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        PushSection(location);
+        PopSection();
+    }
+}
+
+} // namespace
+
+TEST_CASE("Profiler.RingCollect", "[Profiler]")
+{
+    static SourceLocation location{ "RingCollect", __FILE__, __LINE__, 0xFFFFFFFF };
+    Init(0);
+
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        threads.emplace_back([&]() { RecordZones(location, 1000); });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    REQUIRE(WaitForEntries("RingCollect", 4000));
+    REQUIRE(CountEntries("RingCollect") == 4000);
+
+    Finish();
+}
+
+TEST_CASE("Profiler.RingReuse", "[Profiler]")
+{
+    static SourceLocation location{ "RingReuse", __FILE__, __LINE__, 0xFFFFFFFF };
+    Init(0);
+
+    // More threads than there are rings; each ring is free again once the collector has drained it
+    for (uint32_t i = 0; i < 200; i++)
+    {
+        std::thread([&]() { RecordZones(location, 1); }).join();
+        REQUIRE(WaitForZone("RingReuse", i + 1));
+    }
+
+    REQUIRE(FindZone("RingReuse").count == 200);
+
+    Finish();
+}
+
+TEST_CASE("Profiler.InternLocation", "[Profiler]")
+{
+    static SourceLocation first{ "InternFirst", __FILE__, __LINE__, 0xFFFFFFFF };
+    static SourceLocation second{ "InternSecond", __FILE__, __LINE__, 0xFFFFFFFF };
+
+    auto id = InternLocation(first);
+    REQUIRE(id != 0);
+    REQUIRE(InternLocation(first) == id);
+    REQUIRE(InternLocation(second) != id);
+    REQUIRE(strcmp(GetLocation(id).szSection, "InternFirst") == 0);
+    REQUIRE(strcmp(GetLocation(InternLocation(second)).szSection, "InternSecond") == 0);
+}
+
+TEST_CASE("Profiler.DynamicLocation", "[Profiler]")
+{
+    Init(0);
+
+    // The same dynamic section on two threads is one location
+    auto record = []() {
+        for (uint32_t i = 0; i < 10; i++)
+        {
+            PushSectionBase("DynamicZone", 0xFFFFFFFF, __FILE__, 1);
+            PopSection();
+        }
+    };
+    std::thread(record).join();
+    std::thread(record).join();
+
+    REQUIRE(WaitForZone("DynamicZone", 20));
+    auto zones = GetZoneStats();
+    REQUIRE(std::count_if(zones.begin(), zones.end(), [](auto& zone) { return strcmp(GetLocation(zone.location).szSection, "DynamicZone") == 0; }) == 1);
+    REQUIRE(FindZone("DynamicZone").count == 20);
+
+    Finish();
+}
+
+TEST_CASE("Profiler.TicksToNs", "[Profiler]")
+{
+    timer_calibrate_ticks();
+
+    int64_t last = 0;
+    bool monotonic = true;
+    for (uint32_t i = 0; i < 10000; i++)
+    {
+        auto ns = timer_ticks_to_ns(int64_t(timer_get_ticks()));
+        monotonic &= ns >= last;
+        last = ns;
+    }
+    REQUIRE(monotonic);
+
+    auto start = timer_get_ticks();
+    std::this_thread::sleep_for(milliseconds(10));
+    auto elapsed = timer_ticks_to_ns(int64_t(timer_get_ticks() - start));
+    REQUIRE(elapsed >= duration_cast<nanoseconds>(milliseconds(9)).count());
+    REQUIRE(elapsed < duration_cast<nanoseconds>(seconds(1)).count());
+}
+
+TEST_CASE("Profiler.Capture", "[Profiler]")
+{
+    static SourceLocation location{ "CaptureZone", __FILE__, __LINE__, 0xFFFFFFFF };
+    auto path = (fs::temp_directory_path() / "mutils_profiler_test.capture").string();
+    auto truncatedPath = (fs::temp_directory_path() / "mutils_profiler_test_truncated.capture").string();
+
+    Init(0);
+    REQUIRE(BeginCapture(path.c_str()));
+    REQUIRE_FALSE(BeginCapture(path.c_str()));
+
+    RecordZones(location, 50);
+    REQUIRE(WaitForEntries("CaptureZone", 50));
+    EndCapture();
+    Finish();
+
+    // The loaded zones are new locations, with the same names
+    REQUIRE(LoadCapture(path.c_str()));
+    REQUIRE(CountEntries("CaptureZone") == 50);
+
+    // Loading it again reuses the locations
+    auto loadedLocation = FindZone("CaptureZone").location;
+    REQUIRE(loadedLocation != location.id);
+    REQUIRE(LoadCapture(path.c_str()));
+    REQUIRE(CountEntries("CaptureZone") == 50);
+    REQUIRE(FindZone("CaptureZone").location == loadedLocation);
+
+    std::vector<char> data;
+    {
+        std::ifstream in(path, std::ios::in | std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    REQUIRE(data.size() > 1);
+
+    // The file ends with the thread names; cut the last one short
+    {
+        std::ofstream out(truncatedPath, std::ios::out | std::ios::binary);
+        out.write(data.data(), data.size() - 1);
+    }
+    REQUIRE_FALSE(LoadCapture(truncatedPath.c_str()));
+
+    // Not a capture at all
+    {
+        std::ofstream out(truncatedPath, std::ios::out | std::ios::binary);
+        out << "Not a capture";
+    }
+    REQUIRE_FALSE(LoadCapture(truncatedPath.c_str()));
+    REQUIRE_FALSE(LoadCapture((fs::temp_directory_path() / "mutils_profiler_test_missing.capture").string().c_str()));
+
+    fs::remove(path);
+    fs::remove(truncatedPath);
+}
+
+TEST_CASE("Profiler.ExportChromeTrace", "[Profiler]")
+{
+    static SourceLocation lockLocation{ "ExportLock", __FILE__, __LINE__, PROFILE_COL_LOCK, LocationFlag_Lock };
+    auto path = (fs::temp_directory_path() / "mutils_profiler_test.json").string();
+
+    Init(0);
+    NameThread("Export \"Thread\"");
+    PushSectionBase("Quote\"Back\\slash\nNewline", 0xFFFFFFFF, "C:\\src\\file.cpp", 1);
+    PopSection();
+    RecordZones(lockLocation, 1);
+    REQUIRE(WaitForEntries("ExportLock", 1));
+
+    REQUIRE(ExportChromeTrace(path.c_str()));
+    Finish();
+
+    std::string json;
+    {
+        std::ifstream in(path, std::ios::in | std::ios::binary);
+        json.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    fs::remove(path);
+
+    REQUIRE(json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[") == 0);
+    REQUIRE(json.rfind("]}\n") == json.size() - 3);
+    REQUIRE(json.find("\"name\":\"Quote\\\"Back\\\\slash\\u000aNewline\"") != std::string::npos);
+    REQUIRE(json.find("\"file\":\"C:\\\\src\\\\file.cpp\"") != std::string::npos);
+    REQUIRE(json.find("\"args\":{\"name\":\"Export \\\"Thread\\\"\"}") != std::string::npos);
+    REQUIRE(json.find("\"name\":\"ExportLock\",\"cat\":\"lock\"") != std::string::npos);
+}
+
+TEST_CASE("Profiler.ZoneStats", "[Profiler]")
+{
+    static SourceLocation location{ "StatsZone", __FILE__, __LINE__, 0xFFFFFFFF };
+    static SourceLocation outer{ "StatsOuter", __FILE__, __LINE__, 0xFFFFFFFF };
+    static SourceLocation inner{ "StatsInner", __FILE__, __LINE__, 0xFFFFFFFF };
+    const auto shortTime = duration_cast<nanoseconds>(microseconds(100)).count();
+    const auto longTime = duration_cast<nanoseconds>(milliseconds(10)).count();
+
+    Init(0);
+
+    // 97 short zones and 3 long ones; the histogram is good to a quarter of a power of two
+    for (uint32_t i = 0; i < 100; i++)
+    {
+        PushSection(location);
+        BusyWait(i < 97 ? shortTime : longTime);
+        PopSection();
+    }
+
+    PushSection(outer);
+    BusyWait(longTime);
+    PushSection(inner);
+    BusyWait(longTime);
+    PopSection();
+    PopSection();
+
+    REQUIRE(WaitForZone("StatsZone", 100));
+    REQUIRE(WaitForZone("StatsOuter", 1));
+
+    auto zone = FindZone("StatsZone");
+    REQUIRE(zone.count == 100);
+    REQUIRE(zone.minTime >= shortTime);
+    REQUIRE(zone.maxTime >= longTime);
+    REQUIRE(zone.inclusiveTime >= 97 * shortTime + 3 * longTime);
+    REQUIRE(zone.exclusiveTime == zone.inclusiveTime);
+    REQUIRE(zone.p50 >= shortTime * 3 / 4);
+    REQUIRE(zone.p50 < longTime / 2);
+    REQUIRE(zone.p99 >= longTime * 3 / 4);
+
+    // The outer zone's exclusive time leaves out the inner one
+    auto outerZone = FindZone("StatsOuter");
+    auto innerZone = FindZone("StatsInner");
+    REQUIRE(outerZone.inclusiveTime >= 2 * longTime);
+    REQUIRE(innerZone.inclusiveTime >= longTime);
+    REQUIRE(outerZone.exclusiveTime == outerZone.inclusiveTime - innerZone.inclusiveTime);
+
+    ResetZoneStats();
+    REQUIRE(FindZone("StatsZone").count == 0);
+
+    Finish();
+}
+
+#if !defined(MUTILS_PROFILER_TRACY) && !defined(MUTILS_PROFILER_NONE)
+TEST_CASE("Profiler.LockStats", "[Profiler]")
+{
+    const auto holdTime = duration_cast<nanoseconds>(milliseconds(10)).count();
+    std::mutex mutex;
+    std::atomic<bool> held = false;
+
+    auto lock = [&](bool hold) {
+        LOCK_GUARD(mutex, ProfilerTestLock);
+        if (hold)
+        {
+            held = true;
+            BusyWait(holdTime);
+        }
+    };
+
+    Init(0);
+
+    // Wait on a lock held by another thread, then take it freely
+    std::thread holder([&]() { lock(true); });
+    while (!held)
+    {
+    }
+    lock(false);
+    holder.join();
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        lock(false);
+    }
+
+    auto stats = GetLockStats();
+    auto itr = std::find_if(stats.begin(), stats.end(), [](auto& lockStats) { return strcmp(lockStats.location->szSection, "ProfilerTestLock") == 0; });
+    REQUIRE(itr != stats.end());
+    REQUIRE(itr->count == 10);
+    REQUIRE(itr->contended == 1);
+    REQUIRE(itr->maxWait >= holdTime / 2);
+    REQUIRE(itr->maxHold >= holdTime);
+    REQUIRE(itr->totalHold >= itr->maxHold);
+
+    ResetLockStats();
+    stats = GetLockStats();
+    itr = std::find_if(stats.begin(), stats.end(), [](auto& lockStats) { return strcmp(lockStats.location->szSection, "ProfilerTestLock") == 0; });
+    REQUIRE(itr->count == 0);
+
+    Finish();
+}
+#endif
+
+TEST_CASE("Profiler.Allocations", "[Profiler]")
+{
+    static SourceLocation outer{ "AllocOuter", __FILE__, __LINE__, 0xFFFFFFFF };
+    static SourceLocation inner{ "AllocInner", __FILE__, __LINE__, 0xFFFFFFFF };
+
+    Init(0);
+    SetAllocationTracking(true);
+
+    // Charged to the innermost zone open at the time
+    PushSection(outer);
+    PushSection(inner);
+    RecordAllocation(100);
+    RecordAllocation(28);
+    RecordFree(100);
+    PopSection();
+    SetAllocationTracking(false);
+    RecordAllocation(1000);
+    SetAllocationTracking(true);
+    RecordAllocation(5);
+    PopSection();
+    SetAllocationTracking(false);
+
+    REQUIRE(WaitForZone("AllocOuter", 1));
+    auto outerZone = FindZone("AllocOuter");
+    auto innerZone = FindZone("AllocInner");
+    REQUIRE(innerZone.allocations == 2);
+    REQUIRE(innerZone.allocatedBytes == 128);
+    REQUIRE(outerZone.allocations == 1);
+    REQUIRE(outerZone.allocatedBytes == 5);
+
+    Finish();
+}
+
+TEST_CASE("Profiler.RegionBudget", "[Profiler]")
+{
+    static SourceLocation location{ "BudgetRegion", __FILE__, __LINE__, 0xFFFFFFFF };
+    const auto budget = duration_cast<nanoseconds>(milliseconds(1)).count();
+
+    Init(0);
+    SetRegionBudget("BudgetRegion", budget);
+
+    // Every other region runs over
+    for (uint32_t i = 0; i < 10; i++)
+    {
+        RegionScope region(location);
+        if (i % 2)
+        {
+            BusyWait(budget * 3);
+        }
+    }
+
+    auto findRegion = []() {
+        for (auto& region : GetRegionStats())
+        {
+            if (region.name == "BudgetRegion")
+            {
+                return region;
+            }
+        }
+        return RegionStats{};
+    };
+    REQUIRE(WaitFor([&]() { return findRegion().count >= 10; }));
+
+    auto region = findRegion();
+    REQUIRE(region.count == 10);
+    REQUIRE(region.overruns == 5);
+    REQUIRE(region.budget == budget);
+    REQUIRE(region.maxTime >= budget * 3);
+
+    Finish();
+}
@@ -1,4 +1,6 @@
 #include <algorithm>
+#include <cassert>
+#include <cmath>
 
 #include "mutils/time/time_provider.h"
 
@@ -8,6 +10,125 @@ namespace MUtils
 
 using namespace Profiler;
 
+namespace
+{
+// A tick thread this far behind starts again from now, instead of bursting to catch up
+const auto TickResyncLag = milliseconds(250);
+
+// Sleeps are no longer than this, so a tempo change during one is noticed
+const auto MaxTickSleep = milliseconds(10);
+
+// How often the tick thread looks at a virtual clock which is advanced by someone else
+const auto VirtualClockPoll = milliseconds(1);
+
+const double NsPerMinute = 60000000000.0;
+const double NsPerSecond = 1000000000.0;
+
+int64_t ToNs(TimePoint time)
+{
+    return duration_cast<nanoseconds>(time.time_since_epoch()).count();
+}
+
+TimePoint FromNs(int64_t time)
+{
+    return TimePoint(duration_cast<TimePoint::duration>(nanoseconds(time)));
+}
+
+// The first tick on or after a beat
+int64_t TickAtBeat(double beat, uint32_t ticksPerBeat)
+{
+    return int64_t(std::ceil(beat * ticksPerBeat - 1e-6));
+}
+} // namespace
+
+const TempoSegment& TempoMap::SegmentAtTime(int64_t time) const
+{
+    for (uint32_t index = count - 1; index > 0; index--)
+    {
+        if (segments[index].time <= time)
+        {
+            return segments[index];
+        }
+    }
+    return segments[0];
+}
+
+const TempoSegment& TempoMap::SegmentAtBeat(double beat) const
+{
+    for (uint32_t index = count - 1; index > 0; index--)
+    {
+        if (segments[index].beat <= beat)
+        {
+            return segments[index];
+        }
+    }
+    return segments[0];
+}
+
+double TempoMap::BeatAtTime(TimePoint time) const
+{
+    const auto ns = ToNs(time);
+    auto& segment = SegmentAtTime(ns);
+    return segment.beat + double(ns - segment.time) * segment.tempo / NsPerMinute;
+}
+
+TimePoint TempoMap::TimeAtBeat(double beat) const
+{
+    auto& segment = SegmentAtBeat(beat);
+    return FromNs(segment.time + std::llround((beat - segment.beat) * NsPerMinute / segment.tempo));
+}
+
+double TempoMap::TempoAtTime(TimePoint time) const
+{
+    return SegmentAtTime(ToNs(time)).tempo;
+}
+
+int64_t TempoMap::SampleAtTime(TimePoint time) const
+{
+    return std::llround(double(ToNs(time) - sampleZero) * sampleRate / NsPerSecond);
+}
+
+TimePoint TempoMap::TimeAtSample(int64_t sample) const
+{
+    return FromNs(sampleZero + std::llround(double(sample) * NsPerSecond / sampleRate));
+}
+
+double TempoMap::BeatAtSample(int64_t sample) const
+{
+    return BeatAtTime(TimeAtSample(sample));
+}
+
+int64_t TempoMap::SampleAtBeat(double beat) const
+{
+    return SampleAtTime(TimeAtBeat(beat));
+}
+
+void TempoMap::SetTempo(TimePoint time, double tempo)
+{
+    Append(TempoSegment{ ToNs(time), BeatAtTime(time), tempo });
+}
+
+void TempoMap::SetBeat(TimePoint time, double beat)
+{
+    Append(TempoSegment{ ToNs(time), beat, TempoAtTime(time) });
+}
+
+void TempoMap::Append(const TempoSegment& segment)
+{
+    while (count > 0 && segments[count - 1].time >= segment.time)
+    {
+        count--;
+    }
+
+    // Full; the oldest change goes
+    if (count == MaxSegments)
+    {
+        std::copy(segments + 1, segments + count, segments);
+        count--;
+    }
+    segments[count++] = segment;
+}
+
 TimeProvider& TimeProvider::Instance()
 {
     static TimeProvider provider;
@@ -16,20 +137,87 @@ TimeProvider& TimeProvider::Instance()
 
 TimeProvider::TimeProvider()
 {
+    m_consumers = new std::vector<ITimeConsumer*>();
     m_startTime = Now();
+
+    TempoMap map;
+    map.segments[0].time = ToNs(m_startTime);
+    map.sampleZero = ToNs(m_startTime);
+    m_tempoMap.store(map);
+
     SetTempo(120.0, 4.0);
 }
 
+TimeProvider::~TimeProvider()
+{
+    EndThread();
+    delete m_consumers.load();
+}
+
 void TimeProvider::Free()
 {
     EndThread();
 }
 
+VirtualClock::VirtualClock(TimePoint start)
+    : m_now(ToNs(start))
+{
+}
+
+TimePoint VirtualClock::Now() const
+{
+    return FromNs(m_now.load(std::memory_order_acquire));
+}
+
+void VirtualClock::Set(TimePoint time)
+{
+    auto now = m_now.load(std::memory_order_relaxed);
+    const auto ns = ToNs(time);
+    while (ns > now && !m_now.compare_exchange_weak(now, ns, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+}
+
+void VirtualClock::Advance(std::chrono::nanoseconds duration)
+{
+    m_now.fetch_add(std::max(nanoseconds(0), duration).count(), std::memory_order_release);
+}
+
 TimePoint TimeProvider::Now() const
 {
+    auto pClock = m_pClock.load(std::memory_order_acquire);
+    if (pClock)
+    {
+        return pClock->Now();
+    }
     return std::chrono::high_resolution_clock::now();
 }
 
+void TimeProvider::SetClock(VirtualClock* pClock)
+{
+    assert(!m_tickThread.joinable() && "Stop the tick thread before changing clocks");
+
+    // The beat, sample position and time since the start carry on from where they were on the old clock
+    LOCK_GUARD(m_spin_mutex, TP_Lock);
+    const auto oldNow = Now();
+    auto map = m_tempoMap.load();
+    const auto beat = map.BeatAtTime(oldNow);
+    const auto tempo = map.TempoAtTime(oldNow);
+
+    m_pClock = pClock;
+    const auto now = Now();
+    map.SetBeat(now, beat);
+    map.SetTempo(now, tempo);
+    map.sampleZero += ToNs(now) - ToNs(oldNow);
+    m_tempoMap.store(map);
+    m_startTime += now - oldNow;
+}
+
+VirtualClock* TimeProvider::GetClock() const
+{
+    return m_pClock.load();
+}
+
 TimePoint TimeProvider::StartTime() const
 {
     return m_startTime;
@@ -42,47 +230,80 @@ void TimeProvider::ResetStartTime()
 
 void TimeProvider::RegisterConsumer(ITimeConsumer* pConsumer)
 {
-    LOCK_GUARD(m_spin_mutex, TP_Lock);
-    m_consumers.insert(pConsumer);
+    LOCK_GUARD(m_consumerMutex, TP_Consumer_Lock);
+    auto& consumers = *m_consumers.load();
+    if (std::find(consumers.begin(), consumers.end(), pConsumer) == consumers.end())
+    {
+        auto pConsumers = new std::vector<ITimeConsumer*>(consumers);
+        pConsumers->push_back(pConsumer);
+        PublishConsumers(pConsumers);
+    }
 }
 
 void TimeProvider::UnRegisterConsumer(ITimeConsumer* pConsumer)
 {
-    LOCK_GUARD(m_spin_mutex, TP_Lock);
-    m_consumers.erase(pConsumer);
+    LOCK_GUARD(m_consumerMutex, TP_Consumer_Lock);
+    auto& consumers = *m_consumers.load();
+    if (std::find(consumers.begin(), consumers.end(), pConsumer) != consumers.end())
+    {
+        auto pConsumers = new std::vector<ITimeConsumer*>(consumers);
+        pConsumers->erase(std::remove(pConsumers->begin(), pConsumers->end(), pConsumer), pConsumers->end());
+        PublishConsumers(pConsumers);
+    }
+}
+
+// Swap in the new list, then wait out a dispatch which may still be using the old one
+void TimeProvider::PublishConsumers(std::vector<ITimeConsumer*>* pConsumers)
+{
+    auto pOld = m_consumers.exchange(pConsumers);
+    auto dispatch = m_dispatch.load();
+    if (dispatch & 1)
+    {
+        while (m_dispatch.load() == dispatch)
+        {
+            std::this_thread::yield();
+        }
+    }
+    delete pOld;
 }
 
 void TimeProvider::StartThread()
 {
-    auto lastTime = TimeProvider::Instance().Now();
+    // Ticking carries on from the current beat, with the first tick due now
+    double startBeat;
+    {
+        LOCK_GUARD(m_spin_mutex, TP_Lock);
+        startBeat = m_state.load().beat;
+        auto map = m_tempoMap.load();
+        map.SetBeat(Now(), startBeat);
+        m_tempoMap.store(map);
+    }
 
     // A thread which wakes up and ticks
     m_quitTimer = false;
-    m_tickThread = std::thread([&]() {
-        for (;;)
-        {
-            PROFILE_NAME_THREAD(Time_Provider);
+    m_tickThread = std::thread([&, startBeat]() {
+        PROFILE_NAME_THREAD(Time_Provider);
 
-            // Beat at regular intervals, no matter how long our operation takes
-            auto startTime = TimeProvider::Instance().Now();
-            auto nextTime = startTime + m_timePerBeat;
-            auto beat = m_beat.load();
-            auto frame = m_frame.load();
-
-            {
-                PROFILE_SCOPE(TP_Beat);
-                LOCK_GUARD(m_spin_mutex, TP_Lock);
+        // Ticks are on the tempo map's beat grid, so they follow its tempo changes,
+        // and a late tick doesn't delay the ones after it
+        uint32_t ticksPerBeat = 1;
+        auto findTick = [&](double beat) {
+            ticksPerBeat = m_ticksPerBeat.load();
+            return TickAtBeat(beat, ticksPerBeat);
+        };
 
-                m_lastTime = startTime;
-                m_lastBeat = beat;
+        auto version = m_scheduleVersion.load();
+        auto tick = findTick(startBeat);
 
-                for (auto& consumer : m_consumers)
-                {
-                    consumer->Tick();
-                }
+        for (;;)
+        {
+            const auto dueTime = WaitForBeat(double(tick) / ticksPerBeat, version);
 
-                m_frame.store(frame + 1);
-                m_beat.store(beat + 1);
+            // Not dispatched if a new beat was set while we waited
+            auto startTime = Now();
+            if (DispatchTick(tick, ticksPerBeat, version))
+            {
+                RecordJitter(std::max(int64_t(0), int64_t(duration_cast<nanoseconds>(startTime - dueTime).count())));
             }
 
             if (m_quitTimer.load())
@@ -90,11 +311,173 @@ void TimeProvider::StartThread()
                 break;
             }
 
-            std::this_thread::sleep_until(nextTime);
+            tick++;
+            if (m_scheduleVersion.load() != version)
+            {
+                // A new beat was set; the next tick is on it
+                version = m_scheduleVersion.load();
+                tick = findTick(m_state.load().beat);
+            }
+            else if (m_ticksPerBeat.load() != ticksPerBeat)
+            {
+                // The next tick on the new grid, after the one just dispatched
+                tick = findTick(double(tick) / ticksPerBeat);
+            }
+            else if (Now() - m_tempoMap.load().TimeAtBeat(double(tick) / ticksPerBeat) > TickResyncLag)
+            {
+                tick = findTick(m_tempoMap.load().BeatAtTime(Now()));
+                m_resyncs++;
+            }
         }
     });
 }
 
+// Returns false, without ticking, if a new beat was set since the tick was found; the caller finds it again
+bool TimeProvider::DispatchTick(int64_t tick, uint32_t ticksPerBeat, uint64_t version)
+{
+    {
+        LOCK_GUARD(m_spin_mutex, TP_Lock);
+        if (m_scheduleVersion.load() != version)
+        {
+            return false;
+        }
+        auto state = m_state.load();
+        state.beat = double(tick) / ticksPerBeat;
+        m_state.store(state);
+    }
+
+    {
+        PROFILE_SCOPE(TP_Beat);
+        m_dispatch++;
+        for (auto& consumer : *m_consumers.load())
+        {
+            consumer->Tick();
+        }
+        m_dispatch++;
+    }
+
+    // Unless the beat was set during the ticks, it moves on to the next one
+    {
+        LOCK_GUARD(m_spin_mutex, TP_Lock);
+        auto state = m_state.load();
+        if (m_scheduleVersion.load() == version)
+        {
+            state.beat = double(tick + 1) / ticksPerBeat;
+        }
+        state.frame++;
+        m_state.store(state);
+    }
+    return true;
+}
+
+void TimeProvider::RunUntil(TimePoint time)
+{
+    auto pClock = m_pClock.load();
+    assert(pClock && !m_tickThread.joinable() && "RunUntil needs a virtual clock, and no tick thread");
+    if (!pClock || m_tickThread.joinable())
+    {
+        return;
+    }
+
+    PROFILE_SCOPE(TP_RunUntil);
+    auto ticksPerBeat = m_ticksPerBeat.load();
+    auto version = m_scheduleVersion.load();
+    auto tick = TickAtBeat(m_state.load().beat, ticksPerBeat);
+
+    for (;;)
+    {
+        // The clock stands at each tick while it is dispatched
+        const auto dueTime = m_tempoMap.load().TimeAtBeat(double(tick) / ticksPerBeat);
+        if (dueTime > time)
+        {
+            break;
+        }
+        pClock->Set(dueTime);
+
+        DispatchTick(tick, ticksPerBeat, version);
+
+        tick++;
+        if (m_scheduleVersion.load() != version)
+        {
+            version = m_scheduleVersion.load();
+            ticksPerBeat = m_ticksPerBeat.load();
+            tick = TickAtBeat(m_state.load().beat, ticksPerBeat);
+        }
+        else if (m_ticksPerBeat.load() != ticksPerBeat)
+        {
+            const auto beat = double(tick) / ticksPerBeat;
+            ticksPerBeat = m_ticksPerBeat.load();
+            tick = TickAtBeat(beat, ticksPerBeat);
+        }
+    }
+    pClock->Set(time);
+}
+
+// Sleep wakes up late by a varying amount, so the last part of the wait is a spin.
+// A virtual clock doesn't move while we sleep, so it is polled instead.
+// Returns early when a new beat is set, since the beat waited for may no longer be near
+TimePoint TimeProvider::WaitForBeat(double beat, uint64_t version) const
+{
+    const bool virtualClock = m_pClock.load() != nullptr;
+    const auto spinWindow = virtualClock ? nanoseconds(0) : nanoseconds(m_spinWindowNs.load());
+    auto time = m_tempoMap.load().TimeAtBeat(beat);
+    for (auto now = Now(); time - now > spinWindow && !m_quitTimer.load() && m_scheduleVersion.load() == version; now = Now())
+    {
+        std::this_thread::sleep_for(virtualClock ? VirtualClockPoll : std::min<nanoseconds>(time - spinWindow - now, MaxTickSleep));
+        time = m_tempoMap.load().TimeAtBeat(beat);
+    }
+
+    while (Now() < time && !m_quitTimer.load(std::memory_order_relaxed) && m_scheduleVersion.load(std::memory_order_relaxed) == version)
+    {
+        _mm_pause();
+    }
+    return time;
+}
+
+void TimeProvider::RecordJitter(int64_t lateNs)
+{
+    m_jitterTicks.fetch_add(1, std::memory_order_relaxed);
+    m_jitterTotal.fetch_add(lateNs, std::memory_order_relaxed);
+    if (lateNs > m_jitterMax.load(std::memory_order_relaxed))
+    {
+        m_jitterMax.store(lateNs, std::memory_order_relaxed);
+    }
+}
+
+TickJitter TimeProvider::GetTickJitter() const
+{
+    TickJitter jitter;
+    jitter.ticks = m_jitterTicks.load(std::memory_order_relaxed);
+    jitter.meanLate = jitter.ticks ? m_jitterTotal.load(std::memory_order_relaxed) / int64_t(jitter.ticks) : 0;
+    jitter.maxLate = m_jitterMax.load(std::memory_order_relaxed);
+    jitter.resyncs = m_resyncs.load(std::memory_order_relaxed);
+    return jitter;
+}
+
+void TimeProvider::ResetTickJitter()
+{
+    m_jitterTicks = 0;
+    m_jitterTotal = 0;
+    m_jitterMax = 0;
+    m_resyncs = 0;
+}
+
+void TimeProvider::SetTicksPerBeat(uint32_t ticksPerBeat)
+{
+    // The tick loops notice the change, and carry on from the last tick on the new grid
+    m_ticksPerBeat = std::max(1u, ticksPerBeat);
+}
+
+uint32_t TimeProvider::GetTicksPerBeat() const
+{
+    return m_ticksPerBeat;
+}
+
+void TimeProvider::SetSpinWindow(std::chrono::microseconds window)
+{
+    m_spinWindowNs = duration_cast<nanoseconds>(window).count();
+}
+
 void TimeProvider::EndThread()
 {
     m_quitTimer = true;
@@ -104,62 +487,125 @@ void TimeProvider::EndThread()
     }
 }
 
-double TimeProvider::GetBeatAtTime(TimePoint time)
+TempoMap TimeProvider::GetTempoMap() const
+{
+    return m_tempoMap.load();
+}
+
+double TimeProvider::GetBeatAtTime(TimePoint time) const
+{
+    return m_tempoMap.load().BeatAtTime(time);
+}
+
+TimePoint TimeProvider::GetTimeAtBeat(double beat) const
 {
-    auto d = duration_cast<microseconds>(time - m_lastTime).count();
-    auto beat = m_lastBeat.load();
+    return m_tempoMap.load().TimeAtBeat(beat);
+}
+
+int64_t TimeProvider::GetSampleAtTime(TimePoint time) const
+{
+    return m_tempoMap.load().SampleAtTime(time);
+}
+
+TimePoint TimeProvider::GetTimeAtSample(int64_t sample) const
+{
+    return m_tempoMap.load().TimeAtSample(sample);
+}
 
-    auto beatsPerTime = (double)d / (double)duration_cast<microseconds>(GetTimePerBeat()).count();
-    return beat + beatsPerTime;
+double TimeProvider::GetBeatAtSample(int64_t sample) const
+{
+    return m_tempoMap.load().BeatAtSample(sample);
+}
+
+int64_t TimeProvider::GetSampleAtBeat(double beat) const
+{
+    return m_tempoMap.load().SampleAtBeat(beat);
+}
+
+TempoState TimeProvider::GetTempoState() const
+{
+    return m_state.load();
 }
 
-// TODO:
-// Current m_beat is actualy an integer value which increments every tick.
-// The ticks are designed to be very regular, but should the tick event
-// broadcast the time and beat?
+// The beat of the current tick; GetBeatAtTime has the fractional beat at any time
 double TimeProvider::GetBeat() const
 {
-    return m_beat;
+    return m_state.load().beat;
 }
 
 double TimeProvider::GetTempo() const
 {
-    return m_tempo;
+    return m_state.load().tempo;
 }
 
 double TimeProvider::GetQuantum() const
 {
-    return m_quantum;
+    return m_state.load().quantum;
 }
 
 void TimeProvider::SetTempo(double tempo, double quantum)
 {
     LOCK_GUARD(m_spin_mutex, TP_Lock);
-    m_quantum = quantum;
-    m_tempo = tempo;
-    m_timePerBeat = microseconds((uint64_t)(60000000.0 / tempo));
+    auto state = m_state.load();
+    state.tempo = tempo;
+    state.quantum = quantum;
+    m_state.store(state);
+
+    auto map = m_tempoMap.load();
+    map.SetTempo(Now(), tempo);
+    m_tempoMap.store(map);
 }
 
-void TimeProvider::SetBeat(double beat)
+void TimeProvider::SetTempoAt(TimePoint time, double tempo)
 {
     LOCK_GUARD(m_spin_mutex, TP_Lock);
-    m_beat = beat;
+    auto map = m_tempoMap.load();
+    map.SetTempo(time, tempo);
+    m_tempoMap.store(map);
+}
+
+void TimeProvider::SetSampleRate(double sampleRate, TimePoint sampleZero)
+{
+    LOCK_GUARD(m_spin_mutex, TP_Lock);
+    auto map = m_tempoMap.load();
+    map.sampleRate = sampleRate;
+    map.sampleZero = ToNs(sampleZero);
+    m_tempoMap.store(map);
+}
+
+void TimeProvider::SetBeat(double beat)
+{
+    {
+        LOCK_GUARD(m_spin_mutex, TP_Lock);
+        auto state = m_state.load();
+        state.beat = beat;
+        m_state.store(state);
+
+        auto map = m_tempoMap.load();
+        map.SetBeat(Now(), beat);
+        m_tempoMap.store(map);
+
+        // Inside the lock, so a tick dispatched after this sees it
+        m_scheduleVersion++;
+    }
 }
 
 void TimeProvider::SetFrame(uint32_t frame)
 {
     LOCK_GUARD(m_spin_mutex, TP_Lock);
-    m_frame.store(frame);
+    auto state = m_state.load();
+    state.frame = frame;
+    m_state.store(state);
 }
 
 uint32_t TimeProvider::GetFrame() const
 {
-    return m_frame.load();
+    return m_state.load().frame;
 }
 
 std::chrono::microseconds TimeProvider::GetTimePerBeat() const
 {
-    return m_timePerBeat;
+    return microseconds((uint64_t)(60000000.0 / m_state.load().tempo));
 }
 
 } // namespace MUtils
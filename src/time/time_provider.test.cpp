@@ -0,0 +1,234 @@
+#include <catch2/catch.hpp>
+#include <thread>
+
+#include "mutils/time/time_provider.h"
+#include "mutils/time/timeline.h"
+
+using namespace MUtils;
+using namespace std::chrono;
+
+namespace
+{
+struct CountingConsumer : public ITimeConsumer
+{
+    virtual void Tick() override
+    {
+        ticks++;
+    }
+    std::atomic<uint32_t> ticks = 0;
+};
+
+// Switches the provider to a new tick rate at a beat
+struct RateChangingConsumer : public ITimeConsumer
+{
+    virtual void Tick() override
+    {
+        beats.push_back(pProvider->GetBeat());
+        if (pProvider->GetBeat() == changeBeat)
+        {
+            pProvider->SetTicksPerBeat(ticksPerBeat);
+        }
+    }
+    TimeProvider* pProvider = nullptr;
+    double changeBeat = 0;
+    uint32_t ticksPerBeat = 1;
+    std::vector<double> beats;
+};
+
+// The thread runs in real time, so give it plenty
+bool WaitForTicks(CountingConsumer& consumer, uint32_t ticks)
+{
+    for (int i = 0; i < 5000 && consumer.ticks < ticks; i++)
+    {
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    return consumer.ticks >= ticks;
+}
+} // namespace
+
+TEST_CASE("TimeProvider.Ticks", "[TimeProvider]")
+{
+    TimeProvider provider;
+    VirtualClock clock;
+    provider.SetClock(&clock);
+    provider.SetBeat(0.0);
+    CountingConsumer consumer;
+    provider.RegisterConsumer(&consumer);
+
+    // 10 ticks per beat at 600 BPM is a tick every 10ms, from the first one at the start
+    provider.SetTempo(600.0, 4.0);
+    provider.SetTicksPerBeat(10);
+    auto start = provider.Now();
+    provider.RunUntil(start + milliseconds(305));
+    REQUIRE(consumer.ticks == 31);
+    REQUIRE(provider.GetBeat() == Approx(3.1));
+
+    // On schedule, however the clock is stepped
+    for (int i = 0; i < 70; i++)
+    {
+        provider.RunUntil(start + milliseconds(305 + i * 7));
+    }
+    provider.RunUntil(start + milliseconds(1000));
+    REQUIRE(consumer.ticks == 101);
+    REQUIRE(provider.GetBeat() == Approx(10.1));
+
+    provider.UnRegisterConsumer(&consumer);
+}
+
+TEST_CASE("TimeProvider.TickThread", "[TimeProvider]")
+{
+    TimeProvider provider;
+    CountingConsumer consumer;
+    provider.RegisterConsumer(&consumer);
+
+    // Real time, so only loosely bounded
+    provider.SetTempo(600.0, 4.0);
+    provider.SetTicksPerBeat(10);
+    provider.StartThread();
+    REQUIRE(WaitForTicks(consumer, 1));
+    provider.EndThread();
+
+    REQUIRE(consumer.ticks >= 1);
+    REQUIRE(provider.GetBeat() == Approx(consumer.ticks / 10.0));
+
+    auto jitter = provider.GetTickJitter();
+    REQUIRE(jitter.ticks == consumer.ticks);
+    REQUIRE(jitter.maxLate >= jitter.meanLate);
+
+    provider.ResetTickJitter();
+    REQUIRE(provider.GetTickJitter().ticks == 0);
+    provider.UnRegisterConsumer(&consumer);
+}
+
+TEST_CASE("TimeProvider.SetBeatWhileTicking", "[TimeProvider]")
+{
+    TimeProvider provider;
+    CountingConsumer consumer;
+    provider.RegisterConsumer(&consumer);
+    provider.SetTempo(600.0, 4.0);
+    provider.SetTicksPerBeat(10);
+    provider.StartThread();
+    REQUIRE(WaitForTicks(consumer, 2));
+
+    // Forwards; the thread carries on from the new beat, rather than the one it was waiting for
+    provider.SetBeat(1000.0);
+    REQUIRE(WaitForTicks(consumer, consumer.ticks + 2));
+    REQUIRE(provider.GetBeat() >= 1000.0);
+    REQUIRE(provider.GetBeat() < 1100.0);
+
+    // Backwards; the old beat's time is now far away, so it must not be waited for
+    provider.SetBeat(0.0);
+    REQUIRE(WaitForTicks(consumer, consumer.ticks + 2));
+    REQUIRE(provider.GetBeat() < 100.0);
+
+    provider.EndThread();
+    provider.UnRegisterConsumer(&consumer);
+}
+
+TEST_CASE("TimeProvider.Consumers", "[TimeProvider]")
+{
+    TimeProvider provider;
+    CountingConsumer consumers[4];
+    provider.SetTempo(6000.0, 4.0);
+    provider.SetTicksPerBeat(10);
+    provider.StartThread();
+
+    // Registration and tempo changes don't wait for the ticks
+    for (int i = 0; i < 200; i++)
+    {
+        auto& consumer = consumers[i % 4];
+        provider.RegisterConsumer(&consumer);
+        provider.SetTempo(6000.0 + i, 4.0);
+        provider.UnRegisterConsumer(&consumer);
+
+        // Not ticked once it is removed
+        auto ticks = consumer.ticks.load();
+        std::this_thread::sleep_for(microseconds(100));
+        REQUIRE(consumer.ticks == ticks);
+    }
+    provider.EndThread();
+
+    auto state = provider.GetTempoState();
+    REQUIRE(state.tempo == 6199.0);
+    REQUIRE(state.quantum == 4.0);
+}
+
+TEST_CASE("TimeProvider.TempoMap", "[TimeProvider]")
+{
+    TimeProvider provider;
+    const auto start = provider.Now() + seconds(1);
+    provider.SetSampleRate(48000.0, start);
+    provider.SetBeat(0.0);
+    provider.SetTempoAt(start, 120.0);
+    provider.SetTempoAt(start + seconds(2), 60.0);
+
+    // 2 beats a second, then 1
+    REQUIRE(provider.GetBeatAtTime(start + seconds(1)) == Approx(provider.GetBeatAtTime(start) + 2.0));
+    REQUIRE(provider.GetBeatAtTime(start + seconds(4)) == Approx(provider.GetBeatAtTime(start) + 6.0));
+    REQUIRE(provider.GetTempoMap().TempoAtTime(start + seconds(3)) == 60.0);
+
+    // Beats, times and samples convert both ways across the change
+    auto beat = provider.GetBeatAtTime(start + seconds(3));
+    REQUIRE(duration_cast<microseconds>(provider.GetTimeAtBeat(beat) - (start + seconds(3))).count() == 0);
+    REQUIRE(provider.GetSampleAtTime(start + seconds(3)) == 144000);
+    REQUIRE(provider.GetBeatAtSample(144000) == Approx(beat));
+    REQUIRE(provider.GetSampleAtBeat(beat) == 144000);
+}
+
+TEST_CASE("TimeProvider.VirtualClock", "[TimeProvider]")
+{
+    TimeProvider provider;
+    VirtualClock clock;
+    provider.SetClock(&clock);
+    provider.SetBeat(0.0);
+    provider.SetTempo(120.0, 4.0);
+    provider.SetTicksPerBeat(24);
+
+    CountingConsumer consumer;
+    provider.RegisterConsumer(&consumer);
+
+    // An hour at 120 BPM, without waiting for it
+    auto start = provider.Now();
+    auto realStart = high_resolution_clock::now();
+    provider.RunUntil(start + hours(1));
+    REQUIRE(high_resolution_clock::now() - realStart < seconds(10));
+
+    REQUIRE(consumer.ticks == 7200 * 24 + 1);
+    REQUIRE(provider.Now() == start + hours(1));
+    REQUIRE(provider.GetBeat() == Approx(7200.0 + 1.0 / 24));
+    REQUIRE(provider.GetBeatAtTime(provider.Now()) == Approx(7200.0));
+
+    // Stepping carries on from the last tick, and a timeline's time is the provider's
+    provider.RunUntil(start + hours(1) + milliseconds(100));
+    REQUIRE(consumer.ticks == 7200 * 24 + 5);
+
+    Timeline<TimeLineEvent> timeline(16, "Virtual", provider);
+    REQUIRE(timeline.StartTime() == provider.Now());
+
+    provider.UnRegisterConsumer(&consumer);
+    provider.SetClock(nullptr);
+    REQUIRE(provider.Now() - high_resolution_clock::now() < seconds(1));
+}
+
+TEST_CASE("TimeProvider.TicksPerBeatChange", "[TimeProvider]")
+{
+    TimeProvider provider;
+    VirtualClock clock;
+    provider.SetClock(&clock);
+    provider.SetBeat(0.0);
+    provider.SetTempo(60.0, 4.0);
+    provider.SetTicksPerBeat(4);
+
+    RateChangingConsumer consumer;
+    consumer.pProvider = &provider;
+    consumer.changeBeat = 1.0;
+    consumer.ticksPerBeat = 2;
+    provider.RegisterConsumer(&consumer);
+
+    // 4 ticks a beat up to beat 1, then 2; no tick twice
+    provider.RunUntil(provider.Now() + seconds(2));
+    REQUIRE(consumer.beats == std::vector<double>{ 0.0, 0.25, 0.5, 0.75, 1.0, 1.5, 2.0 });
+
+    provider.UnRegisterConsumer(&consumer);
+    provider.SetClock(nullptr);
+}
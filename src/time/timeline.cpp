@@ -3,3 +3,194 @@
 #include "mutils/logger/logger.h"
 #include "mutils/time/timeline.h"
 
+
+namespace MUtils
+{
+
+// Express link of an event on a level above 0; a null event is the head of the index
+TimeLineEvent*& TimeLineIndex::NextAt(TimeLineEvent* pEvent, uint32_t level)
+{
+    assert(level > 0 && level < TimeLineIndexLevels);
+    return pEvent ? pEvent->m_pIndexNext[level - 1] : m_pHead[level - 1];
+}
+
+// Each extra level is taken with 1 in 4 chance
+uint32_t TimeLineIndex::RandomLevels()
+{
+    // xorshift
+    m_seed ^= m_seed << 13;
+    m_seed ^= m_seed >> 17;
+    m_seed ^= m_seed << 5;
+
+    uint32_t levels = 1;
+    auto bits = m_seed;
+    while (levels < TimeLineIndexLevels && (bits & 3) == 0)
+    {
+        levels++;
+        bits >>= 2;
+    }
+    return levels;
+}
+
+void TimeLineIndex::Insert(gsl::not_null<TimeLineEvent*> pEvent)
+{
+    const auto time = pEvent->m_time;
+
+    // Find the last event at or before our time, on every level
+    TimeLineEvent* pUpdate[TimeLineIndexLevels] = {};
+    TimeLineEvent* pPrevious = nullptr;
+    for (uint32_t level = m_levels - 1; level > 0; level--)
+    {
+        auto pNext = NextAt(pPrevious, level);
+        while (pNext && pNext->m_time <= time)
+        {
+            pPrevious = pNext;
+            pNext = NextAt(pPrevious, level);
+        }
+        pUpdate[level] = pPrevious;
+    }
+
+    IListItem* pPos = pPrevious;
+    auto pNext = pPrevious ? pPrevious->m_pNext : m_list.Front();
+    while (pNext && static_cast<TimeLineEvent*>(pNext)->m_time <= time)
+    {
+        pPos = pNext;
+        pNext = pNext->m_pNext;
+    }
+    m_list.InsertAfter(pPos, pEvent);
+
+    // Link in on the upper levels
+    auto levels = RandomLevels();
+    for (uint32_t level = m_levels; level < levels; level++)
+    {
+        pUpdate[level] = nullptr;
+    }
+    m_levels = std::max(m_levels, levels);
+
+    for (uint32_t level = 1; level < levels; level++)
+    {
+        auto& pLink = NextAt(pUpdate[level], level);
+        pEvent->m_pIndexNext[level - 1] = pLink;
+        pLink = pEvent;
+    }
+    pEvent->m_indexLevels = levels;
+}
+
+void TimeLineIndex::Erase(gsl::not_null<TimeLineEvent*> pEvent)
+{
+    const auto time = pEvent->m_time;
+
+    TimeLineEvent* pPrevious = nullptr;
+    for (uint32_t level = m_levels - 1; level > 0; level--)
+    {
+        auto pNext = NextAt(pPrevious, level);
+        while (pNext && pNext->m_time < time)
+        {
+            pPrevious = pNext;
+            pNext = NextAt(pPrevious, level);
+        }
+
+        if (level < pEvent->m_indexLevels)
+        {
+            // On this level; step over events at the same time until we reach it.
+            // (Above our levels this could overshoot, since events at the same time may follow us)
+            while (pNext != pEvent.get())
+            {
+                assert(pNext && pNext->m_time == time);
+                pPrevious = pNext;
+                pNext = NextAt(pPrevious, level);
+            }
+            NextAt(pPrevious, level) = pEvent->m_pIndexNext[level - 1];
+        }
+    }
+
+    m_list.Erase(pEvent);
+    pEvent->m_indexLevels = 0;
+}
+
+TimeLineEvent* TimeLineIndex::SpliceDue(TimePoint upTo, IntrusiveList& out, size_t& count)
+{
+    count = 0;
+    auto pFirst = static_cast<TimeLineEvent*>(m_list.Front());
+    if (!pFirst || pFirst->m_time > upTo)
+    {
+        return nullptr;
+    }
+
+    // Find the last due event, skipping down from the top level
+    TimeLineEvent* pUpdate[TimeLineIndexLevels] = {};
+    TimeLineEvent* pPrevious = nullptr;
+    for (uint32_t level = m_levels - 1; level > 0; level--)
+    {
+        auto pNext = NextAt(pPrevious, level);
+        while (pNext && pNext->m_time <= upTo)
+        {
+            pPrevious = pNext;
+            pNext = NextAt(pPrevious, level);
+        }
+        pUpdate[level] = pPrevious;
+    }
+
+    IListItem* pLast = pPrevious ? pPrevious : pFirst;
+    while (pLast->m_pNext && static_cast<TimeLineEvent*>(pLast->m_pNext)->m_time <= upTo)
+    {
+        pLast = pLast->m_pNext;
+    }
+
+    // Everything up to pUpdate goes, so the heads move on to what followed it
+    for (uint32_t level = 1; level < m_levels; level++)
+    {
+        if (pUpdate[level])
+        {
+            m_pHead[level - 1] = pUpdate[level]->m_pIndexNext[level - 1];
+        }
+    }
+
+    // Counted, so both lists keep an exact size
+    count = 1;
+    for (IListItem* pItem = pFirst; pItem != pLast; pItem = pItem->m_pNext)
+    {
+        count++;
+    }
+
+    out.Splice(out.Back(), m_list, pFirst, pLast, count);
+    return pFirst;
+}
+
+void TimeLineIndex::Reset()
+{
+    m_list.Reset();
+    std::fill(std::begin(m_pHead), std::end(m_pHead), nullptr);
+    m_levels = 1;
+}
+
+TimeLineIndex::Walker::Walker(TimeLineIndex& index)
+    : m_index(index)
+    , m_pCurrent(index.Front())
+{
+    std::fill(std::begin(m_pPrevious), std::end(m_pPrevious), nullptr);
+}
+
+void TimeLineIndex::Walker::Next()
+{
+    assert(m_pCurrent);
+    for (uint32_t level = 1; level < m_pCurrent->m_indexLevels; level++)
+    {
+        m_pPrevious[level] = m_pCurrent;
+    }
+    m_pCurrent = static_cast<TimeLineEvent*>(m_pCurrent->m_pNext);
+}
+
+void TimeLineIndex::Walker::Erase()
+{
+    assert(m_pCurrent);
+    auto pVictim = m_pCurrent;
+    for (uint32_t level = 1; level < pVictim->m_indexLevels; level++)
+    {
+        m_index.NextAt(m_pPrevious[level], level) = pVictim->m_pIndexNext[level - 1];
+    }
+    m_pCurrent = static_cast<TimeLineEvent*>(m_index.m_list.Erase(pVictim));
+    pVictim->m_indexLevels = 0;
+}
+
+} // namespace MUtils
@@ -0,0 +1,347 @@
+#include <catch2/catch.hpp>
+#include <random>
+#include <thread>
+
+#include "mutils/time/timeline.h"
+
+using namespace MUtils;
+using namespace std::chrono;
+
+namespace
+{
+struct NoteEvent : public TimeLineEvent
+{
+    DECLARE_POOL_ITEM(NoteEvent);
+    NoteEvent(IMemoryPool* pPool, uint64_t id)
+        : TimeLineEvent(pPool, id)
+    {
+    }
+};
+
+// Reports one of two types, as a timeline of a base event type would see
+struct MixedEvent : public TimeLineEvent
+{
+    struct Control
+    {
+    };
+
+    MixedEvent(IMemoryPool* pPool, uint64_t id)
+        : TimeLineEvent(pPool, id)
+    {
+    }
+
+    virtual ctti::type_id_t GetType() const override
+    {
+        return control ? ctti::type_id<Control>() : ctti::type_id<MixedEvent>();
+    }
+
+    bool control = false;
+};
+
+NoteEvent* MakeEvent(Timeline<NoteEvent>& timeline, TimePoint time)
+{
+    auto pEvent = timeline.GetEventPool().Alloc();
+    pEvent->SetTime(time);
+    return pEvent;
+}
+} // namespace
+
+TEST_CASE("Timeline.Order", "[Timeline]")
+{
+    Timeline<NoteEvent> timeline(16);
+    auto start = TimeProvider::Instance().Now();
+
+    // Out of order, with some at the same time
+    std::mt19937 rand(1);
+    const int Count = 5000;
+    for (int i = 0; i < Count; i++)
+    {
+        timeline.StoreTimeEvent(MakeEvent(timeline, start + milliseconds(rand() % 1000)));
+    }
+
+    std::vector<NoteEvent*> events;
+    timeline.GetTimeEvents(events);
+    REQUIRE(events.size() == Count);
+
+    size_t total = 0;
+    TimePoint last = TimePoint::min();
+    for (int step = 0; step <= 1000; step += 50)
+    {
+        timeline.DequeTimeEvents(events, NoteEvent::TypeID(), start + milliseconds(step));
+        for (auto pEvent : events)
+        {
+            REQUIRE(pEvent->m_time >= last);
+            REQUIRE(pEvent->m_time <= start + milliseconds(step));
+            REQUIRE(pEvent->m_triggered);
+            last = pEvent->m_time;
+        }
+        total += events.size();
+    }
+    REQUIRE(total == Count);
+
+    // Nothing left to dequeue
+    timeline.DequeTimeEvents(events, NoteEvent::TypeID(), start + seconds(10));
+    REQUIRE(events.empty());
+}
+
+TEST_CASE("Timeline.Free", "[Timeline]")
+{
+    Timeline<NoteEvent> timeline(16);
+    auto start = TimeProvider::Instance().Now();
+
+    std::vector<NoteEvent*> stored;
+    for (int i = 0; i < 100; i++)
+    {
+        stored.push_back(MakeEvent(timeline, start + milliseconds(i)));
+        timeline.StoreTimeEvent(stored.back());
+    }
+
+    // Freeing an event directly takes it out of the timeline
+    for (int i = 0; i < 100; i += 2)
+    {
+        stored[i]->Free();
+    }
+
+    std::vector<NoteEvent*> events;
+    timeline.DequeTimeEvents(events, NoteEvent::TypeID(), start + milliseconds(1000));
+    REQUIRE(events.size() == 50);
+    REQUIRE(events[0] == stored[1]);
+
+    events[0]->Free();
+    timeline.GetTimeEvents(events);
+    REQUIRE(events.size() == 49);
+    REQUIRE(timeline.GetEventPool().GetStats().liveItems == 49);
+}
+
+TEST_CASE("Timeline.Types", "[Timeline]")
+{
+    Timeline<MixedEvent> timeline(16);
+    auto start = TimeProvider::Instance().Now();
+
+    for (int i = 0; i < 200; i++)
+    {
+        auto pEvent = timeline.GetEventPool().Alloc();
+        pEvent->SetTime(start + milliseconds(i));
+        pEvent->control = (i % 4) == 0;
+        timeline.StoreTimeEvent(pEvent);
+    }
+
+    std::vector<MixedEvent*> events;
+    timeline.DequeTimeEvents(events, ctti::type_id<MixedEvent::Control>(), start + milliseconds(99));
+    REQUIRE(events.size() == 25);
+    for (auto pEvent : events)
+    {
+        REQUIRE(pEvent->control);
+    }
+
+    // Freeing a pending event of either type unlinks it from its own queue
+    timeline.GetTimeEvents(events);
+    for (auto pEvent : events)
+    {
+        if (!pEvent->m_triggered && pEvent->m_time >= start + milliseconds(100))
+        {
+            pEvent->Free();
+        }
+    }
+
+    timeline.DequeTimeEvents(events, ctti::type_id<MixedEvent>(), start + milliseconds(1000));
+    REQUIRE(events.size() == 75);
+    for (auto pEvent : events)
+    {
+        REQUIRE(!pEvent->control);
+    }
+
+    timeline.DequeTimeEvents(events, ctti::type_id<MixedEvent::Control>(), start + milliseconds(1000));
+    REQUIRE(events.empty());
+}
+
+TEST_CASE("Timeline.Producers", "[Timeline]")
+{
+    Timeline<NoteEvent> timeline(16);
+    auto start = TimeProvider::Instance().Now();
+
+    // Producers store while the consumer dequeues
+    const int Threads = 4;
+    const int PerThread = 1000;
+    std::vector<std::thread> producers;
+    for (int t = 0; t < Threads; t++)
+    {
+        producers.emplace_back([&, t]() {
+            for (int i = 0; i < PerThread; i++)
+            {
+                timeline.StoreTimeEvent(MakeEvent(timeline, start + milliseconds((i * Threads + t) % 500)));
+            }
+        });
+    }
+
+    std::vector<NoteEvent*> events;
+    size_t total = 0;
+    while (total < Threads * PerThread)
+    {
+        timeline.DequeTimeEvents(events, NoteEvent::TypeID(), start + milliseconds(500));
+        for (size_t i = 1; i < events.size(); i++)
+        {
+            REQUIRE(events[i - 1]->m_time <= events[i]->m_time);
+        }
+        total += events.size();
+    }
+
+    for (auto& producer : producers)
+    {
+        producer.join();
+    }
+    REQUIRE(total == Threads * PerThread);
+
+    // A staged event can be freed before the consumer sees it
+    auto pEvent = MakeEvent(timeline, start);
+    timeline.StoreTimeEvent(pEvent);
+    pEvent->Free();
+    timeline.DequeTimeEvents(events, NoteEvent::TypeID(), start + milliseconds(500));
+    REQUIRE(events.empty());
+}
+
+TEST_CASE("Timeline.Range", "[Timeline]")
+{
+    Timeline<NoteEvent> timeline(16);
+    auto start = TimeProvider::Instance().Now();
+
+    for (int i = 0; i < 1000; i++)
+    {
+        timeline.StoreTimeEvent(MakeEvent(timeline, start + milliseconds(999 - i)));
+    }
+
+    auto range = timeline.DequeTimeEvents(NoteEvent::TypeID(), start + milliseconds(99));
+    REQUIRE(range.Size() == 100);
+    REQUIRE(range.First()->m_time == start);
+    REQUIRE(range.Last()->m_time == start + milliseconds(99));
+
+    size_t count = 0;
+    for (auto pEvent : range)
+    {
+        REQUIRE(pEvent->m_triggered);
+        count++;
+    }
+    REQUIRE(count == 100);
+
+    // Past events are behind it in the triggered list; the next range picks up from there
+    auto next = timeline.DequeTimeEvents(NoteEvent::TypeID(), start + milliseconds(199));
+    REQUIRE(next.Size() == 100);
+    REQUIRE(next.First()->m_time == start + milliseconds(100));
+
+    // Detached events leave the timeline, and go back to the pool through the list
+    IntrusiveList kept;
+    timeline.Detach(range, kept);
+    REQUIRE(kept.Size() == 100);
+
+    std::vector<NoteEvent*> events;
+    timeline.GetTimeEvents(events);
+    REQUIRE(events.size() == 900);
+
+    kept.FreeAll();
+    REQUIRE(timeline.GetEventPool().GetStats().liveItems == 900);
+
+    events.clear();
+    timeline.DequeTimeEvents(events, NoteEvent::TypeID(), start + milliseconds(1000));
+    REQUIRE(events.size() == 800);
+    REQUIRE(events.front()->m_time == start + milliseconds(200));
+}
+
+TEST_CASE("Timeline.Expire", "[Timeline]")
+{
+    Timeline<NoteEvent> timeline(16);
+    auto start = TimeProvider::Instance().Now() - seconds(100);
+
+    // A long event first, which used to hold up the short ones behind it
+    auto pLong = MakeEvent(timeline, start);
+    pLong->SetTime(start, milliseconds(95000));
+    timeline.StoreTimeEvent(pLong);
+    for (int i = 1; i < 100; i++)
+    {
+        timeline.StoreTimeEvent(MakeEvent(timeline, start + milliseconds(i * 10)));
+    }
+
+    // Half dequeued, half left pending
+    std::vector<NoteEvent*> events;
+    timeline.DequeTimeEvents(events, NoteEvent::TypeID(), start + milliseconds(495));
+    REQUIRE(events.size() == 50);
+
+    // Bounded
+    REQUIRE(timeline.ExpireEvents(10, 30) == 30);
+    REQUIRE(timeline.ExpireEvents(10) == 69);
+
+    // Only the long one is left, until it ends
+    timeline.GetTimeEvents(events);
+    REQUIRE(events.size() == 1);
+    REQUIRE(events[0] == pLong);
+    REQUIRE(timeline.ExpireEvents(10) == 0);
+    REQUIRE(timeline.GetEventPool().GetStats().liveItems == 1);
+    REQUIRE(timeline.ExpireEvents(0) == 1);
+}
+
+TEST_CASE("Timeline.ExpireLongPending", "[Timeline]")
+{
+    Timeline<NoteEvent> timeline(16);
+    auto start = TimeProvider::Instance().Now() - seconds(100);
+
+    // Long events which nobody dequeues, ahead of short ones which have ended
+    std::vector<NoteEvent*> longEvents;
+    for (int i = 0; i < 1000; i++)
+    {
+        auto pEvent = MakeEvent(timeline, start + milliseconds(i));
+        pEvent->SetTime(pEvent->m_time, milliseconds(200000));
+        timeline.StoreTimeEvent(pEvent);
+        longEvents.push_back(pEvent);
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        timeline.StoreTimeEvent(MakeEvent(timeline, start + milliseconds(1000 + i)));
+    }
+
+    REQUIRE(timeline.ExpireEvents(10, 5) == 5);
+    REQUIRE(timeline.ExpireEvents(10) == 5);
+    REQUIRE(timeline.ExpireEvents(10) == 0);
+
+    // Freeing a pending event takes it out of the expiry heap too
+    for (auto pEvent : longEvents)
+    {
+        pEvent->Free();
+    }
+    REQUIRE(timeline.GetEventPool().GetStats().liveItems == 0);
+    REQUIRE(timeline.ExpireEvents(0) == 0);
+}
+
+TEST_CASE("Timeline.ExpireEarlyExits", "[Timeline]")
+{
+    Timeline<NoteEvent> timeline(16);
+    auto start = TimeProvider::Instance().Now() - seconds(100);
+
+    // Rounds of events which leave the triggered list before expiry, some after an expiry pass
+    for (int round = 0; round < 20; round++)
+    {
+        // The last 10 are later than any dequeue, but still old enough to expire
+        for (int i = 0; i < 30; i++)
+        {
+            timeline.StoreTimeEvent(MakeEvent(timeline, start + milliseconds(round * 30 + i + (i >= 20 ? 50000 : 0))));
+        }
+
+        auto first = timeline.DequeTimeEvents(NoteEvent::TypeID(), start + milliseconds(round * 30 + 9));
+        REQUIRE(first.Size() == 10);
+        if (round % 2)
+        {
+            REQUIRE(timeline.ExpireEvents(1000) == 0);
+        }
+        auto second = timeline.DequeTimeEvents(NoteEvent::TypeID(), start + milliseconds(round * 30 + 19));
+        REQUIRE(second.Size() == 10);
+
+        IntrusiveList kept;
+        timeline.Detach(first, kept);
+        second.First()->Free();
+        kept.FreeAll();
+    }
+
+    // What is left: 9 triggered and 10 pending per round
+    REQUIRE(timeline.GetEventPool().GetStats().liveItems == 20 * 19);
+    REQUIRE(timeline.ExpireEvents(10, 100) == 100);
+    REQUIRE(timeline.ExpireEvents(10) == 20 * 19 - 100);
+    REQUIRE(timeline.GetEventPool().GetStats().liveItems == 0);
+}
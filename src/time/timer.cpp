@@ -1,10 +1,22 @@
+#include <atomic>
 #include <chrono> // Timing
 #include <iomanip>
+#include <mutex>
 
 #include "mutils/logger/logger.h"
 #include "mutils/time/timer.h"
 #include <mutils/time/profiler.h>
 
+#if defined(MUTILS_TIMER_TSC) && (defined(_M_X64) || defined(__x86_64__))
+#define TIMER_HAS_TSC 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#endif
+
 using namespace std::chrono;
 
 namespace MUtils
@@ -12,6 +24,39 @@ namespace MUtils
 
 timer globalTimer;
 
+namespace
+{
+std::once_flag gTicksCalibrateOnce;
+std::atomic<bool> gTicksCalibrated = false;
+std::atomic<bool> gTicksAreTsc = false;
+double gNsPerTick = 1.0;
+
+#ifdef TIMER_HAS_TSC
+// Only an invariant counter ticks at a constant rate across cores and power states
+bool tsc_is_invariant()
+{
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 0x80000000);
+    if (uint32_t(regs[0]) < 0x80000007)
+    {
+        return false;
+    }
+    __cpuid(regs, 0x80000007);
+    return (regs[3] & (1 << 8)) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+    {
+        return false;
+    }
+    return (edx & (1 << 8)) != 0;
+#endif
+}
+#endif
+
+} // namespace
+
 uint64_t timer_get_time_now()
 {
     return duration_cast<nanoseconds>(high_resolution_clock::now().time_since_epoch()).count();
@@ -48,4 +93,59 @@ double timer_to_ms(uint64_t value)
     return double(value / 1000000.0);
 }
 
+// Measures the counter against the steady clock, the first time it is called
+void timer_calibrate_ticks()
+{
+    std::call_once(gTicksCalibrateOnce, []() {
+#ifdef TIMER_HAS_TSC
+        if (tsc_is_invariant())
+        {
+            auto clockStart = steady_clock::now();
+            auto tickStart = __rdtsc();
+            while (steady_clock::now() - clockStart < milliseconds(10))
+            {
+            }
+            auto clockEnd = steady_clock::now();
+            auto tickEnd = __rdtsc();
+
+            gNsPerTick = double(duration_cast<nanoseconds>(clockEnd - clockStart).count()) / double(tickEnd - tickStart);
+            gTicksAreTsc = true;
+        }
+#endif
+        gTicksCalibrated.store(true, std::memory_order_release);
+    });
+}
+
+// The unit is fixed by the first call, so ticks taken at any time can be compared
+uint64_t timer_get_ticks()
+{
+    if (!gTicksCalibrated.load(std::memory_order_acquire))
+    {
+        timer_calibrate_ticks();
+    }
+
+#ifdef TIMER_HAS_TSC
+    if (gTicksAreTsc.load(std::memory_order_relaxed))
+    {
+        return __rdtsc();
+    }
+#endif
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t timer_ticks_to_ns(int64_t ticks)
+{
+    if (!gTicksCalibrated.load(std::memory_order_acquire))
+    {
+        timer_calibrate_ticks();
+    }
+    return int64_t(ticks * gNsPerTick);
+}
+
+bool timer_ticks_are_tsc()
+{
+    timer_calibrate_ticks();
+    return gTicksAreTsc;
+}
+
 } // namespace MUtils